@@ -0,0 +1,273 @@
+/*
+ * Requests over loopback with TLS 1.2 and 1.3, to a server with a self-signed certificate made at startup.
+ * Checks the small, large and echoed responses decrypt to what was sent. See ServConfig.tls_cert_file
+ *
+ * Usage: https [port]
+ */
+#include "hunk.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define DEF_PORT   (4800)
+#define BIG_SIZE   (256 * 1024) // Above the zero-copy threshold
+#define ECHO_SIZE  (100 * 1024)
+#define KEEP_ALIVE (8)
+
+static const char HELLO_REQ[] = "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+static const char BIG_REQ[] = "GET /big HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static char big[BIG_SIZE];
+static char body[ECHO_SIZE];
+static char cert_file[] = "/tmp/hunk-https-cert-XXXXXX";
+static char key_file[] = "/tmp/hunk-https-key-XXXXXX";
+
+void hello(Request *req, ResWriter *res) {
+  (void)req;
+  (void)res;
+  HK_write("hello", 5);
+}
+
+void large(Request *req, ResWriter *res) {
+  (void)req;
+  (void)res;
+  HK_write(big, BIG_SIZE);
+}
+
+void echo(Request *req, ResWriter *res) {
+  (void)res;
+  HK_write_body(req, 0, req->body.len);
+}
+
+Route routes[] = {
+    {GET, "/hello", hello, false, false},
+    {GET, "/big", large, false, false},
+    {POST, "/echo", echo, true, false},
+    {0, 0, 0, 0, 0},
+};
+
+/*
+ * Whether the kernel has the tls ULP the server hands its records to, see tls_init
+ */
+static bool has_ktls(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+
+  // An unconnected socket refuses it with ENOTCONN when the module is loaded
+  int res = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+  int err = errno;
+  close(fd);
+  return res == 0 || err == ENOTCONN;
+}
+
+/*
+ * Write a self-signed certificate for localhost and its key to cert_file and key_file
+ */
+static X509 *make_cert(void) {
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509     *cert = X509_new();
+  if (!key || !cert)
+    goto fail;
+
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+  X509_set_pubkey(cert, key);
+
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  if (!X509_sign(cert, key, EVP_sha256()))
+    goto fail;
+
+  int   cfd = mkstemp(cert_file), kfd = mkstemp(key_file);
+  FILE *cf = (cfd >= 0) ? fdopen(cfd, "w") : NULL;
+  FILE *kf = (kfd >= 0) ? fdopen(kfd, "w") : NULL;
+  bool  written = cf && kf && PEM_write_X509(cf, cert) && PEM_write_PrivateKey(kf, key, NULL, NULL, 0, NULL, NULL);
+  if (cf)
+    fclose(cf);
+  if (kf)
+    fclose(kf);
+  if (!written)
+    goto fail;
+
+  EVP_PKEY_free(key);
+  return cert;
+
+fail:
+  ERR_print_errors_fp(stderr);
+  EVP_PKEY_free(key);
+  X509_free(cert);
+  return NULL;
+}
+
+static pid_t start_server(uint16_t port) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  Server serv = HK_new_serv();
+  serv.port = port;
+  serv.routes = routes;
+  serv.config.tls_cert_file = cert_file;
+  serv.config.tls_key_file = key_file;
+  exit(HK_listen(&serv) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int connect_server(uint16_t port, pid_t pid) {
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // The server may still be starting, or have failed to
+  for (int i = 0; i < 100 && waitpid(pid, NULL, WNOHANG) == 0; i++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      return fd;
+
+    close(fd);
+    usleep(10000);
+  }
+
+  return -1;
+}
+
+static int write_all(SSL *ssl, const char *buf, size_t len) {
+  while (len > 0) {
+    int n = SSL_write(ssl, buf, len);
+    if (n <= 0)
+      return -1;
+    buf += n, len -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * Read one response and check its content is len bytes equal to expected
+ */
+static int read_res(SSL *ssl, const char *expected, size_t len) {
+  static char buf[BIG_SIZE + 4096];
+  size_t      got = 0, head_len = 0, content_len = 0;
+
+  while (!head_len || got < head_len + content_len) {
+    if (got == sizeof(buf))
+      return -1;
+
+    int n = SSL_read(ssl, buf + got, sizeof(buf) - got);
+    if (n <= 0)
+      return -1;
+    got += n;
+
+    char *end = head_len ? NULL : memmem(buf, got, "\r\n\r\n", 4);
+    if (end) {
+      head_len = end + 4 - buf;
+      char *cl = memmem(buf, head_len, "Content-Length: ", 16);
+      if (!cl || strncmp(buf, "HTTP/1.1 200", 12) != 0)
+        return -1;
+      content_len = strtoul(cl + 16, NULL, 10);
+    }
+  }
+
+  return (content_len == len && got == head_len + len && memcmp(buf + head_len, expected, len) == 0) ? 0 : -1;
+}
+
+/*
+ * Handshake with version and send KEEP_ALIVE rounds of requests on the connection
+ */
+static int run(SSL_CTX *ctx, int version, uint16_t port, pid_t pid) {
+  int fd = connect_server(port, pid);
+  if (fd < 0)
+    return -1;
+
+  SSL_CTX_set_min_proto_version(ctx, version);
+  SSL_CTX_set_max_proto_version(ctx, version);
+  SSL *ssl = SSL_new(ctx);
+  int  res = -1;
+  if (!ssl || SSL_set_fd(ssl, fd) != 1 || SSL_set1_host(ssl, "localhost") != 1 || SSL_connect(ssl) != 1)
+    goto out;
+
+  char head[128];
+  int  head_len = snprintf(head, sizeof(head), "POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: %d\r\n\r\n",
+                           ECHO_SIZE);
+  for (int i = 0; i < KEEP_ALIVE; i++) {
+    if (write_all(ssl, HELLO_REQ, sizeof(HELLO_REQ) - 1) < 0 || read_res(ssl, "hello", 5) < 0)
+      goto out;
+    if (write_all(ssl, BIG_REQ, sizeof(BIG_REQ) - 1) < 0 || read_res(ssl, big, BIG_SIZE) < 0)
+      goto out;
+    if (write_all(ssl, head, head_len) < 0 || write_all(ssl, body, ECHO_SIZE) < 0
+        || read_res(ssl, body, ECHO_SIZE) < 0)
+      goto out;
+  }
+
+  printf("%-8s %s, %d rounds ok\n", SSL_get_version(ssl), SSL_get_cipher(ssl), KEEP_ALIVE);
+  res = 0;
+
+out:
+  if (res < 0) {
+    fprintf(stderr, "%s: the requests failed\n", (version == TLS1_3_VERSION) ? "TLSv1.3" : "TLSv1.2");
+    ERR_print_errors_fp(stderr);
+  }
+  SSL_free(ssl);
+  close(fd);
+  return res;
+}
+
+int main(int argc, char **argv) {
+  uint16_t port = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEF_PORT;
+  if (port == 0) {
+    fprintf(stderr, "usage: %s [port]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // The server would fail to start, not the requests
+  if (!has_ktls()) {
+    fprintf(stderr, "kernel TLS is not available, load the tls module to run this bench\n");
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < BIG_SIZE; i++)
+    big[i] = 'a' + i % 26;
+  for (size_t i = 0; i < ECHO_SIZE; i++)
+    body[i] = 'A' + (i * 7) % 26;
+
+  X509 *cert = make_cert();
+  if (!cert)
+    return EXIT_FAILURE;
+
+  // The client trusts only the self-signed certificate
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  int      res = -1;
+  if (ctx && X509_STORE_add_cert(SSL_CTX_get_cert_store(ctx), cert) == 1) {
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    pid_t pid = start_server(port);
+    if (pid > 0) {
+      res = run(ctx, TLS1_2_VERSION, port, pid);
+      if (res == 0)
+        res = run(ctx, TLS1_3_VERSION, port, pid);
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+    }
+  }
+
+  SSL_CTX_free(ctx);
+  X509_free(cert);
+  unlink(cert_file);
+  unlink(key_file);
+  return (res < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
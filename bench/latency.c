@@ -0,0 +1,222 @@
+/*
+ * Request latency with the server waiting for completions in interrupt mode and with NAPI busy polling.
+ * See ServConfig.busy_poll_us
+ *
+ * Usage: latency [requests] [busy_poll_us] [port]
+ *        latency serve [busy_poll_us] [port]
+ *        latency <server address> [requests] [busy_poll_us] [port]
+ *
+ * With no address both runs are over loopback. Loopback traffic goes through the backlog NAPI, which has
+ * no NAPI id, so there is nothing to busy poll and both runs take the same path. That only checks the setup.
+ * To measure busy polling, run "latency serve" on a host whose NIC the requests come in through, once with
+ * busy_poll_us 0 and once with it set, and run the client with its address from another host each time.
+ * The client busy polls its own socket for busy_poll_us, 0 turns that off
+ */
+#include "hunk.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEF_REQUESTS     (100000)
+#define DEF_BUSY_POLL_US (50)
+#define DEF_PORT         (4700)
+#define WARMUP           (1000)
+
+static const char REQ[] = "GET /ping HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+void ping(Request *req, ResWriter *res) {
+  (void)req;
+  (void)res;
+  HK_write("pong", 4);
+}
+
+Route routes[] = {
+    {GET, "/ping", ping, false, false},
+    {0, 0, 0, 0, 0},
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static pid_t start_server(uint16_t port, uint32_t busy_poll_us) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  Server serv = HK_new_serv();
+  serv.port = port;
+  serv.routes = routes;
+  serv.config.busy_poll_us = busy_poll_us;
+  serv.config.prefer_busy_poll = (busy_poll_us > 0);
+  exit(HK_listen(&serv) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int connect_server(const char *host, uint16_t port, uint32_t busy_poll_us) {
+  struct addrinfo  hints = {0};
+  struct addrinfo *addr;
+  char             service[8];
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &addr) != 0) {
+    fprintf(stderr, "%s: unknown address\n", host);
+    return -1;
+  }
+
+  // The server may still be starting
+  for (int i = 0; i < 100; i++) {
+    int fd = socket(addr->ai_family, SOCK_STREAM, 0);
+    if (fd < 0)
+      break;
+
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+      freeaddrinfo(addr);
+      int enable = 1, usecs = busy_poll_us;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+      if (busy_poll_us)
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+      return fd;
+    }
+
+    close(fd);
+    usleep(10000);
+  }
+
+  freeaddrinfo(addr);
+  return -1;
+}
+
+/*
+ * Send one request at a time on a kept alive connection and keep the time of each round trip
+ */
+static int run(int fd, uint64_t *lat, size_t nreqs) {
+  char buf[512];
+
+  for (size_t i = 0; i < nreqs + WARMUP; i++) {
+    uint64_t start = now_ns();
+    if (write(fd, REQ, sizeof(REQ) - 1) != sizeof(REQ) - 1)
+      return -1;
+
+    // The response is small enough to arrive whole, it ends with the content
+    size_t len = 0;
+    while (len < 4 || memcmp(buf + len - 4, "pong", 4) != 0) {
+      ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+      if (n <= 0)
+        return -1;
+      len += n;
+    }
+
+    if (i >= WARMUP)
+      lat[i - WARMUP] = now_ns() - start;
+  }
+
+  return 0;
+}
+
+static void report(const char *mode, uint64_t *lat, size_t nreqs) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < nreqs; i++)
+    total += lat[i];
+
+  qsort(lat, nreqs, sizeof(uint64_t), cmp_u64);
+  printf("%-12s mean %7.2fus  p50 %7.2fus  p90 %7.2fus  p99 %7.2fus  p99.9 %7.2fus  max %8.2fus\n", mode,
+         total / (double)nreqs / 1000, lat[nreqs / 2] / 1000.0, lat[nreqs * 90 / 100] / 1000.0,
+         lat[nreqs * 99 / 100] / 1000.0, lat[nreqs * 999 / 1000] / 1000.0, lat[nreqs - 1] / 1000.0);
+}
+
+/*
+ * Measure the server on host, or one started here when host is NULL
+ */
+static int bench(const char *mode, const char *host, uint16_t port, uint32_t busy_poll_us, uint64_t *lat,
+                 size_t nreqs) {
+  pid_t pid = (host) ? 0 : start_server(port, busy_poll_us);
+  if (pid < 0)
+    return -1;
+
+  int fd = connect_server((host) ? host : "127.0.0.1", port, busy_poll_us);
+  int res = (fd >= 0) ? run(fd, lat, nreqs) : -1;
+  if (fd >= 0)
+    close(fd);
+
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+  if (res < 0) {
+    fprintf(stderr, "%s: the benchmark failed\n", mode);
+    return -1;
+  }
+
+  report(mode, lat, nreqs);
+  return 0;
+}
+
+static int usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [requests] [busy_poll_us] [port]\n"
+          "       %s serve [busy_poll_us] [port]\n"
+          "       %s <server address> [requests] [busy_poll_us] [port]\n",
+          name, name, name);
+  return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+  const char *name = argv[0];
+
+  // Only the server, for a client on another host
+  if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+    uint32_t busy_poll_us = (argc > 2) ? strtoul(argv[2], NULL, 10) : 0;
+    uint16_t port = (argc > 3) ? strtoul(argv[3], NULL, 10) : DEF_PORT;
+    if (port == 0)
+      return usage(name);
+
+    pid_t pid = start_server(port, busy_poll_us);
+    return (pid > 0 && waitpid(pid, NULL, 0) == pid) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Only the client, of a server started with serve
+  const char *host = NULL;
+  if (argc > 1 && argv[1][strspn(argv[1], "0123456789")] != '\0') {
+    host = argv[1];
+    argc--, argv++;
+  }
+
+  size_t   nreqs = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEF_REQUESTS;
+  uint32_t busy_poll_us = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEF_BUSY_POLL_US;
+  uint16_t port = (argc > 3) ? strtoul(argv[3], NULL, 10) : DEF_PORT;
+  if (nreqs == 0 || (!host && busy_poll_us == 0) || port == 0)
+    return usage(name);
+
+  uint64_t *lat = malloc(sizeof(uint64_t) * nreqs);
+  if (!lat)
+    return EXIT_FAILURE;
+
+  int res;
+  if (host) {
+    printf("%zu requests to %s, one at a time\n", nreqs, host);
+    res = bench("remote", host, port, busy_poll_us, lat, nreqs);
+  } else {
+    printf("%zu requests over loopback, one at a time. It has no NAPI to busy poll, both runs take the same path\n",
+           nreqs);
+    res = bench("interrupt", NULL, port, 0, lat, nreqs);
+    if (res == 0)
+      res = bench("busy poll", NULL, port + 1, busy_poll_us, lat, nreqs);
+  }
+
+  free(lat);
+  return (res < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
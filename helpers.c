@@ -14,25 +14,80 @@ int HK_write_body(Request *req, size_t offset, size_t size) {
   return _HK_write_body(req, offset, size);
 }
 
+/*
+ * Similar to HK_write but sends data in place, without copying it.
+ * data should stay valid until release is called
+ */
+int HK_write_ref(const void *data, size_t size, Release release, void *ctx) {
+  IOV iov = {(void *)data, size};
+  return _HK_writev_ref(&iov, 1, release, ctx);
+}
+
+/*
+ * Similar to HK_write_ref but for a list of buffers, with a single release
+ */
+int HK_writev_ref(const struct iovec *iov, size_t iovcnt, Release release, void *ctx) {
+  return _HK_writev_ref(iov, iovcnt, release, ctx);
+}
+
+/*
+ * Allocate memory that lives until the response is sent
+ */
+void *HK_alloc(Request *req, size_t size) {
+  return _HK_alloc(req, size);
+}
+
+/*
+ * Copy the statistics of the current worker
+ */
+int HK_get_stats(ServStats *stats) {
+  return _HK_get_stats(stats);
+}
+
 int HK_set_header(ResWriter *res, Header header) {
-  if ((!header.key || header.key[0] == '\0') || (!header.value || header.value[0] == '\0'))
-    return -1;
-  res->headers[res->nheaders++] = header;
-  return 0;
+  return _HK_set_header(res, header);
+}
+
+/*
+ * Send the response content in chunks, written by the streamer as the previous chunk is sent
+ */
+int HK_stream(ResWriter *res, Streamer streamer, void *ctx) {
+  return _HK_stream(res, streamer, ctx);
+}
+
+/*
+ * Pass the request content to the reader as it's received
+ */
+int HK_read_body(Request *req, BodyReader reader, void *ctx) {
+  return _HK_read_body(req, reader, ctx);
+}
+
+/*
+ * Move the request content into fd without copying it through userspace
+ */
+int HK_splice_body(Request *req, int fd, BodyReader reader, void *ctx) {
+  return _HK_splice_body(req, fd, reader, ctx);
 }
 
 /*
  * Return the index of the header if it exists or -1 if it does not exist
  */
 int HK_get_header(const Request *req, const char *key) {
-  return _get_pair((Pair *)req->headers, req->headers_count, key);
+  return _HK_get_header((Request *)req, key);
+}
+
+/*
+ * Similar to HK_get_header but for the headers classified while parsing, without searching
+ */
+int HK_get_known_header(const Request *req, KnownHeader header) {
+  return _HK_get_known_header((Request *)req, header);
 }
 
 /*
  * Return the index of the URL parameter if it exists or -1 if it does not exist
  */
 int HK_get_param(const Request *req, const char *key) {
-  return _get_pair((Pair *)req->params, req->params_count, key);
+  return _HK_get_param((Request *)req, key);
 }
 
 /*
@@ -15,7 +15,17 @@
 #define DEF_MAX_URL_PARAMS  (500)     // Default maximum number of url Parameter
 #define DEF_MAX_WRITE_CALLS (7)       // Default maximum number of HK_write calls
 #define DEF_MAX_CONNS       (500)     // Default maximum number of concurrent clients
+#define DEF_BODY_WINDOW     (65536)   // Default size of the buffers used to stream request content
 #define DEF_POOL_SIZE       (DEF_MAX_CONNS * DEF_MAX_HEAD_SIZE)
+#define DEF_MEM_CACHE_SIZE  (33554432) // Default maximum size of recycled buffers kept outside the pool
+#define DEF_QUEUE_TARGET    (0)       // Default target queueing delay in milli-seconds, off
+#define DEF_QUEUE_INTERVAL  (100)     // Default interval the queueing delay may stay above the target
+#define DEF_RING_ENTRIES    (4096)    // Default number of io_uring submission queue entries
+#define DEF_HEADER_TIMEOUT  (10000)   // Default time in milli-seconds a new connection has to send its request head
+#define DEF_BODY_MIN_RATE   (1024)    // Default minimum rate of request content in bytes per second
+#define DEF_IDLE_TIMEOUT    (60000)   // Default time in milli-seconds a kept alive connection may stay idle
+#define DEF_SEND_TIMEOUT    (30000)   // Default time in milli-seconds a response send may stall
+#define DEF_REBALANCE_INTERVAL (1000) // Default time in milli-seconds between multi_core load comparisons
 
 typedef enum Method {
   CATCHALL,
@@ -30,6 +40,29 @@ typedef enum Method {
   PATCH,
 } Method;
 
+/*
+ * Request headers classified while parsing, see HK_get_known_header
+ */
+typedef enum KnownHeader {
+  HEADER_HOST,
+  HEADER_CONNECTION,
+  HEADER_CONTENT_LENGTH,
+  HEADER_CONTENT_TYPE,
+  HEADER_TRANSFER_ENCODING,
+  HEADER_EXPECT,
+  HEADER_ACCEPT,
+  HEADER_ACCEPT_ENCODING,
+  HEADER_COOKIE,
+  HEADER_AUTHORIZATION,
+  HEADER_IF_NONE_MATCH,
+  HEADER_IF_MODIFIED_SINCE,
+  HEADER_USER_AGENT,
+  HEADER_RANGE,
+  HEADER_ORIGIN,
+  HEADER_REFERER,
+  NKNOWN_HEADERS,
+} KnownHeader;
+
 typedef enum Status {
   /*** 1xx Informational responses ***/
   STATUSCONTINUE = 100,
@@ -122,8 +155,9 @@ typedef struct Request {
   // Target HTTP port
   uint16_t port;
 
-  // HTTP path
-  char *path;
+  // HTTP path, without the url parameters
+  char  *path;
+  size_t path_len;
 
   // All path parameters
   Param *params;
@@ -137,6 +171,15 @@ typedef struct Request {
   // The number of headers
   size_t headers_count;
 
+  // Used internally for the index + 1 of each known header, 0 if the request doesn't have it
+  uint16_t known[NKNOWN_HEADERS];
+
+  // Used internally for the raw headers and url parameters, split on first use
+  char  *head;
+  char  *head_end;
+  char  *query;
+  size_t query_len;
+
   // The request content
   struct {
     struct iovec *iov;
@@ -152,9 +195,30 @@ typedef struct ResWriter {
   size_t  len;
   size_t  nheaders;
   Header *headers;
+
+  // Set by HK_stream, the content is sent with Transfer-Encoding: chunked
+  bool chunked;
 } ResWriter;
 
 typedef void (*Handler)(Request *req, ResWriter *resWriter);
+
+/*
+ * Called with each part of the request content as it's received, then once with NULL when it ends.
+ * Return 0 on success, -1 to drop the connection
+ */
+typedef int (*BodyReader)(struct iovec *segment, void *ctx);
+
+/*
+ * Called once a buffer passed by reference is no longer used by the response
+ */
+typedef void (*Release)(void *ctx);
+
+/*
+ * Called each time the previous chunk is fully sent, to write the next one with HK_write.
+ * Return a positive number to be called again, 0 when done, -1 to drop the connection.
+ * A positive number with nothing written drops the connection too, an empty chunk would end the stream
+ */
+typedef int (*Streamer)(void *ctx);
 typedef struct Route {
   // The route HTTP method
   Method method;
@@ -166,8 +230,21 @@ typedef struct Route {
   Handler handler;
 
   bool uses_body;
+
+  // Run the handler once the head is received and stream the content with HK_read_body or HK_splice_body
+  bool streams_body;
 } Route;
 
+/*
+ * The pages backing the memory pool, see ServConfig.huge_pages
+ */
+typedef enum HugePages {
+  HUGE_PAGES_NONE,
+  HUGE_PAGES_THP, // Transparent huge pages
+  HUGE_PAGES_2MB,
+  HUGE_PAGES_1GB,
+} HugePages;
+
 typedef struct ServConfig {
   /*
    * Maximum size for the request content in bytes
@@ -191,20 +268,31 @@ typedef struct ServConfig {
    * Maximum size of the request and response headers in bytes
    * Should be at least 8KB in size. which is the default value
    *
+   * Each connection keeps a request buffer of this size. The response head buffer starts at 512 bytes,
+   * grows up to this size while the head is formatted, and is released once the response is sent
+   *
    * Default is 8KB or 8192 bytes
    */
   uint32_t max_headers_size;
 
   /*
-   * Maximum number of HK_write calls that can be made in a handler.
-
-   * This number Should be as small as possible since it consumes memory.
-   * It consumes 32 bytes * (max_writes_per_handler + 1) * max_concurrent_clients,
-   * for example with default configs this will consume 32 * 8 * 500 or 128000 bytes
+   * Deprecated, HK_write calls are no longer limited.
+   *
+   * The response grows on demand, extending the last buffer in place when it can,
+   * so this value is ignored and only kept for compatibility.
    *
    * Default is 7
    */
   uint16_t max_writes_per_handler;
+
+  /*
+   * Size of each of the two buffers used to stream the request content to routes with streams_body
+   * Should be at least 1KB
+   *
+   * Default is 64KB or 65536 bytes
+   */
+  uint32_t body_window_size;
+
   /*
    * Maximum number of url parameters in a request path
    * Should be larger than 0
@@ -228,7 +316,8 @@ typedef struct ServConfig {
    * Hunk will create a connection pool of this size, which will consume memory per client.
    * for example by default it will consume 500 * 256 or 128000 bytes
    *
-   * connections accepted when the pool is full will be closed immediately
+   * Hunk stops accepting connections when the pool is nearly full and leaves them in the listen backlog,
+   * connections accepted when the pool is full are answered with 503 and closed immediately
    *
    * Default is 500
    */
@@ -245,19 +334,193 @@ typedef struct ServConfig {
    */
   bool multi_core;
 
+  /*
+   * The cpus to run multi_core workers on, as a list like "0-3,8,10-11"
+   * Only the cpus the process is allowed to run on are used
+   *
+   * When it's NULL all the allowed cpus are used, except the isolated ones
+   *
+   * Default is NULL
+   */
+  const char *worker_cpus;
+
+  /*
+   * Run one multi_core worker per physical core instead of one per hyperthread
+   *
+   * Default is false
+   */
+  bool one_worker_per_core;
+
+  /*
+   * How often multi_core workers compare their load, in milli-seconds.
+   * A worker with more connections than the others hands some of its idle kept alive ones
+   * to the least loaded worker, so long lived connections don't keep a core busy while others idle
+   * 0 disables it
+   *
+   * Default is 1000
+   */
+  uint32_t rebalance_interval_ms;
+
+  /*
+   * The certificate chain and private key of an HTTPS listener, PEM files.
+   * When they're set every connection is TLS. The handshake is done with OpenSSL
+   * and the records are encrypted and decrypted by the kernel, kTLS
+   *
+   * Needs Hunk built with TLS=1 and the kernel tls module
+   *
+   * Default is NULL
+   */
+  const char *tls_cert_file;
+  const char *tls_key_file;
+
   /*
    * Do not allocate memory per client. use the pool only
    *
    * Default is false
    */
   bool pool_only;
+
+  /*
+   * Back the memory pool with huge pages to avoid TLB misses
+   * The pool size is rounded up to the huge page size
+   *
+   * Falls back to the next smaller pages when the system has none to give,
+   * down to transparent huge pages and then regular pages
+   *
+   * Default is HUGE_PAGES_NONE
+   */
+  HugePages huge_pages;
+
+  /*
+   * Fault in all the pool pages at startup so traffic never waits on first touch page faults
+   *
+   * Default is false
+   */
+  bool prefault_pool;
+
+  /*
+   * Lock the pool in memory so its pages are never swapped out. Implies prefault_pool
+   * Ignored if it exceeds RLIMIT_MEMLOCK
+   *
+   * Default is false
+   */
+  bool lock_pool;
+
+  /*
+   * Maximum bytes of idle buffers kept for reuse outside the memory pool
+   *
+   * Request content larger than a tenth of the pool, and anything that doesn't fit in it,
+   * is mapped outside the pool. Such buffers are recycled in power of two page classes
+   * instead of being unmapped, and their pages are freed lazily while idle
+   * 0 disables it
+   *
+   * Default is 32MB
+   */
+  size_t mem_cache_size;
+
+  /*
+   * Every this many milli-seconds give the pages of the memory pool that stayed free
+   * since the last time back to the system, so the memory taken at peak traffic isn't kept forever
+   *
+   * The pool isn't registered with io_uring when this is enabled, since registered pages are pinned
+   * Ignored when the pool is locked or backed by HUGE_PAGES_2MB or HUGE_PAGES_1GB
+   * 0 disables it
+   *
+   * Default is 0
+   */
+  uint32_t reclaim_interval_ms;
+
+  /*
+   * Target queueing delay in milli-seconds of every request, kept alive ones included. It's measured from when its
+   * connection started waiting for it, or the server was last idle when that's later, to when its head is handled
+   *
+   * Once the delay stays above the target for queue_interval_ms, requests are answered with 503 and
+   * Retry-After and their connection closed, more often the longer it lasts, until it drops below the target again
+   * 0 disables it
+   *
+   * Default is 0
+   */
+  uint32_t queue_target_ms;
+
+  /*
+   * How long in milli-seconds the queueing delay may stay above queue_target_ms before requests are rejected
+   *
+   * Default is 100
+   */
+  uint32_t queue_interval_ms;
+
+  /*
+   * Submission queue entries of the io_uring of each worker
+   *
+   * The completion queue is made large enough for the completions of every connection,
+   * and at least twice this size. Both are clamped to what the kernel allows
+   *
+   * Default is 4096
+   */
+  uint32_t ring_entries;
+
+  /*
+   * Milli-seconds a new connection has to send its request line and headers
+   * 0 disables it
+   *
+   * Default is 10000
+   */
+  uint32_t header_timeout_ms;
+
+  /*
+   * Minimum rate of request content in bytes per second
+   *
+   * After header_timeout_ms of grace from the end of the head, the content received so far
+   * has to keep up with this rate, or the connection is dropped
+   * 0 disables it
+   *
+   * Default is 1024
+   */
+  uint32_t body_min_rate;
+
+  /*
+   * Milli-seconds a kept alive connection may wait for its next request
+   * 0 disables it
+   *
+   * Default is 60000
+   */
+  uint32_t idle_timeout_ms;
+
+  /*
+   * Milli-seconds a response send may make no progress, while the client isn't reading it
+   * 0 disables it
+   *
+   * Default is 30000
+   */
+  uint32_t send_timeout_ms;
+
+  /*
+   * Busy poll the network device for this many micro-seconds while waiting for completions,
+   * instead of sleeping until its interrupt. Trades CPU time for lower latency
+   *
+   * Registers NAPI busy polling with the io_uring of each worker, Linux 6.9 and later,
+   * and sets SO_BUSY_POLL on the listening socket and so on every accepted one.
+   * Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN
+   * 0 disables it
+   *
+   * Default is 0
+   */
+  uint32_t busy_poll_us;
+
+  /*
+   * With busy_poll_us, ask the device to keep its interrupts off while it's being busy polled
+   * Takes effect when the net device has napi_defer_hard_irqs and gro_flush_timeout set
+   *
+   * Default is false
+   */
+  bool prefer_busy_poll;
 } ServConfig;
 
 typedef struct Server {
   // Server port
   uint16_t port;
 
-  // Socket timeout in milli-second
+  // Deprecated, replaces config.idle_timeout_ms when it's set
   size_t timeout;
 
   // Used internally for the number of routes
@@ -269,12 +532,95 @@ typedef struct Server {
   ServConfig config;
 } Server;
 
+/*
+ * Measured cost of one of the paths used to move data
+ */
+typedef struct PathStats {
+  // Number of operations and bytes sent on this path
+  uint64_t ops;
+  uint64_t bytes;
+
+  // Moving averages per KB, of the CPU time spent submitting and the time until completion
+  uint64_t cpu_ns_per_kb;
+  uint64_t lat_ns_per_kb;
+} PathStats;
+
+/*
+ * Statistics of the current worker, see HK_get_stats
+ */
+typedef struct ServStats {
+  // Responses sent by copying them into the socket, and with zero-copy
+  PathStats copy;
+  PathStats zc;
+
+  // Request content spliced into files with HK_splice_body
+  PathStats splice;
+
+  // Responses sent with the receive of the next request linked to them, completing once for both
+  uint64_t linked_sends;
+
+  // Responses larger than this are sent with zero-copy, a quarter of it when sent from the registered pool
+  uint64_t zc_threshold;
+
+  // How many times the threshold moved, and why it last did
+  uint64_t    zc_threshold_changes;
+  const char *zc_threshold_reason;
+
+  // Buffers outside the pool reused from the cache, newly mapped, and the bytes of idle ones
+  uint64_t mem_cache_hits;
+  uint64_t mem_cache_misses;
+  uint64_t mem_cache_bytes;
+
+  // Resident memory of the worker and its peak, as of the last reclaim, and the pool bytes given back so far
+  uint64_t rss_bytes;
+  uint64_t rss_peak_bytes;
+  uint64_t reclaimed_bytes;
+
+  // Moving average of the delay from accepting a connection to receiving the head of its first request
+  uint64_t queue_delay_ns;
+
+  // Requests answered with 503 under load, and how many times accepting was paused
+  uint64_t rejected;
+  uint64_t accept_pauses;
+
+  // The io_uring setup the kernel supported, its queue sizes, and what's registered with it
+  const char *ring_mode;
+  uint32_t    ring_sq_entries;
+  uint32_t    ring_cq_entries;
+  bool        ring_fd_registered;
+  bool        napi_registered; // NAPI busy polling, see ServConfig.busy_poll_us
+
+  // Times the completion queue was found full with completions held back in the kernel,
+  // and times the kernel reported it had dropped completions
+  uint64_t cq_overflows;
+  uint64_t cq_drops;
+
+  // Connections dropped for missing a deadline, see ServConfig.header_timeout_ms
+  uint64_t deadlines_missed;
+
+  // Idle connections handed to other multi_core workers and taken from them, see ServConfig.rebalance_interval_ms
+  uint64_t handoffs_out;
+  uint64_t handoffs_in;
+
+  // TLS handshakes done with the keys handed to the kernel, and those that failed or were abandoned
+  uint64_t tls_handshakes;
+  uint64_t tls_failed;
+} ServStats;
+
 int HK_listen(Server *serv);
 int HK_get_header(const Request *req, const char *key);
+int HK_get_known_header(const Request *req, KnownHeader header);
 int HK_get_param(const Request *req, const char *key);
 int HK_write(void *data, size_t size);
 int HK_write_body(Request *req, size_t offset, size_t size);
+int HK_write_ref(const void *data, size_t size, Release release, void *ctx);
+int HK_writev_ref(const struct iovec *iov, size_t iovcnt, Release release, void *ctx);
+void *HK_alloc(Request *req, size_t size);
 int HK_set_header(ResWriter *res, Header header);
+int HK_stream(ResWriter *res, Streamer streamer, void *ctx);
+int HK_read_body(Request *req, BodyReader reader, void *ctx);
+int HK_splice_body(Request *req, int fd, BodyReader reader, void *ctx);
+int HK_get_stats(ServStats *stats);
 
 Server HK_new_serv();
 
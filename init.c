@@ -4,8 +4,14 @@ struct io_uring ring = {0};
 
 ServConfig config = {0};
 
-int      pipe_in = 0, pipe_out = 0, pipe_sz = 0, nullfd = 0;
-size_t   pagesize = 0;
-MPool    pool = {0};
-Conn    *current_conn = NULL;
-Request *current_req = NULL;
+struct ssl_ctx_st *tls_ctx = NULL;
+
+int       pipe_in = 0, pipe_out = 0, pipe_sz = 0, nullfd = 0;
+size_t    pagesize = 0;
+MPool     pool = {0};
+ServStats stats = {0};
+SendTune  tune = {0};
+Codel     codel = {0};
+Balance   balance = {0};
+Conn     *current_conn = NULL;
+Request  *current_req = NULL;
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#ifndef BALANCE_H
+#define BALANCE_H
+
+#include "types.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Share the loads of nworkers and create the sockets they hand connections over on, before they're forked
+ */
+static inline int init_balance(int nworkers) {
+  balance.loads = mmap(NULL, sizeof(WorkerLoad) * nworkers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (balance.loads == MAP_FAILED) {
+    balance.loads = NULL;
+    return -1;
+  }
+
+  balance.socks = malloc(sizeof(int) * nworkers * 2);
+  if (!balance.socks)
+    goto fail;
+
+  // Stream sockets, so a burst of handoffs queues up in the socket buffer. One byte carries each fd
+  for (int i = 0; i < nworkers; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, &balance.socks[i * 2]) < 0) {
+      while (--i >= 0) {
+        close(balance.socks[i * 2]);
+        close(balance.socks[i * 2 + 1]);
+      }
+      goto fail;
+    }
+  }
+
+  balance.nworkers = nworkers;
+  return 0;
+
+fail:
+  free(balance.socks);
+  munmap(balance.loads, sizeof(WorkerLoad) * nworkers);
+  balance.loads = NULL;
+  balance.socks = NULL;
+  return -1;
+}
+
+/*
+ * Keep the receiving end of worker self, and the sending ends of all the workers
+ */
+static inline void join_balance(int self) {
+  if (!balance.loads)
+    return;
+
+  balance.self = self;
+  for (int i = 0; i < balance.nworkers; i++)
+    if (i != self)
+      close(balance.socks[i * 2]);
+  close(balance.socks[self * 2 + 1]);
+}
+
+/*
+ * The parent keeps none of the sockets once the workers are forked, so a worker's receiving end is closed when
+ * it exits and handing it a connection fails
+ */
+static inline void leave_balance(void) {
+  if (!balance.loads)
+    return;
+
+  for (int i = 0; i < balance.nworkers * 2; i++)
+    close(balance.socks[i]);
+  free(balance.socks);
+  balance.socks = NULL;
+}
+
+/*
+ * Publish the load of this worker, and pick the least loaded worker to hand connections to.
+ * Return how many to hand it, 0 when the load is even enough
+ */
+static inline uint32_t pick_peer(int *peer) {
+  uint32_t mine = pool.nconns, total = 0, least = UINT32_MAX, nlive = 0;
+
+  __atomic_store_n(&balance.loads[balance.self].conns, mine, __ATOMIC_RELAXED);
+  for (int i = 0; i < balance.nworkers; i++) {
+    // The connections of a worker that exited are gone with it
+    if (__atomic_load_n(&balance.loads[i].gone, __ATOMIC_RELAXED))
+      continue;
+
+    uint32_t conns = __atomic_load_n(&balance.loads[i].conns, __ATOMIC_RELAXED);
+    total += conns;
+    nlive++;
+    if (i != balance.self && conns < least) {
+      least = conns;
+      *peer = i;
+    }
+  }
+
+  if (least == UINT32_MAX)
+    return 0;
+
+  uint32_t avg = total / nlive;
+  if (mine <= avg + avg / REBALANCE_SLACK_DIV || mine - least < 2)
+    return 0;
+
+  // Never more than evens the two out, or takes this worker below the average
+  uint32_t n = (mine - least) / 2;
+  if (n > mine - avg)
+    n = mine - avg;
+  if (n > HANDOFF_MAX)
+    n = HANDOFF_MAX;
+
+  // Counted for the peer right away, so other workers don't all pick it before it publishes again
+  __atomic_fetch_add(&balance.loads[*peer].conns, n, __ATOMIC_RELAXED);
+  return n;
+}
+
+/*
+ * Send the socket fd to worker peer, which adopts it, see handle_adopt.
+ * When the peer exited it's marked gone for all the workers, and is never picked again
+ */
+static inline int send_conn(int peer, int fd) {
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } control = {0};
+  char byte = 0;
+  IOV  iov = {&byte, 1};
+  MSG  msg = {0};
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  if (sendmsg(balance.socks[peer * 2 + 1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != 1) {
+    if (errno == EPIPE || errno == ECONNREFUSED)
+      __atomic_store_n(&balance.loads[peer].gone, true, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  return 0;
+}
+
+#endif
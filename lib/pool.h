@@ -6,6 +6,11 @@
 #include "utils.h"
 #include <sys/mman.h>
 
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
 static inline int find_freec() {
   uint64_t *word;
   for (size_t i = 0; i < config.max_concurrent_clients; i++) {
@@ -24,44 +29,192 @@ static inline int find_freec() {
   return -1;
 }
 
+/*
+ * Map size bytes aligned to and backed by transparent huge pages
+ */
+static inline void *new_thp_mem(size_t size) {
+  char *mem = new_mem(size + HUGE_2MB);
+  if (!mem)
+    return NULL;
+
+  // Trim the mapping to a huge page boundary so the whole pool can be backed by huge pages
+  size_t head = (HUGE_2MB - ((uintptr_t)mem & (HUGE_2MB - 1))) & (HUGE_2MB - 1);
+  if (head)
+    munmap(mem, head);
+  munmap(mem + head + size, HUGE_2MB - head);
+  mem += head;
+
+  if (madvise(mem, size, MADV_HUGEPAGE) < 0) {
+    munmap(mem, size);
+    return NULL;
+  }
+
+  return mem;
+}
+
+/*
+ * Map the pool memory with the pages asked for in config.huge_pages,
+ * falling back to smaller pages when the system has none to give.
+ * size is rounded up to the huge page size of the mapping
+ */
+static inline void *MP_map(size_t *size) {
+  void *mem;
+  for (int kind = config.huge_pages; kind > HUGE_PAGES_NONE; kind--) {
+    size_t hsize = (kind == HUGE_PAGES_1GB) ? HUGE_1GB : HUGE_2MB;
+    size_t len = (*size + hsize - 1) & ~(hsize - 1);
+    if (kind == HUGE_PAGES_THP) {
+      mem = new_thp_mem(len);
+    } else {
+      int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | ((kind == HUGE_PAGES_1GB) ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+      mem = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+      mem = (mem == MAP_FAILED) ? NULL : mem;
+    }
+
+    if (mem) {
+      pool.huge_pages = kind;
+      *size = len;
+      return mem;
+    }
+  }
+
+  pool.huge_pages = HUGE_PAGES_NONE;
+  return new_mem(*size);
+}
+
+/*
+ * Fault in and lock the pool pages as asked for in the config
+ */
+static inline void MP_prefault(void) {
+  size_t pool_size = pool.npages * pagesize;
+  if (config.lock_pool && mlock(pool.bpool, pool_size) == 0) {
+    pool.locked = true;
+    return;
+  }
+
+  if (!config.prefault_pool && !config.lock_pool)
+    return;
+
+  if (madvise(pool.bpool, pool_size, MADV_POPULATE_WRITE) == 0)
+    return;
+
+  // Older kernels, touch every page instead
+  for (size_t offset = 0; offset < pool_size; offset += pagesize)
+    ((volatile char *)pool.bpool)[offset] = 0;
+}
+
+/*
+ * Set up the unit bitmaps of MP_reclaim, unless the pool pages can't be given back
+ */
+static inline int MP_init_reclaim(void) {
+  bool hugetlb = (pool.huge_pages == HUGE_PAGES_2MB || pool.huge_pages == HUGE_PAGES_1GB);
+  if (!config.reclaim_interval_ms || pool.locked || hugetlb)
+    return 0;
+
+  // Giving back part of a transparent huge page would split it
+  pool.reclaim_unit = (pool.huge_pages == HUGE_PAGES_THP) ? HUGE_2MB : pagesize;
+  size_t nunits = (pool.npages * pagesize) / pool.reclaim_unit;
+  pool.idle_units = calloc(BITMAP_ELEMENTS(nunits), sizeof(uint64_t));
+  pool.reclaimed_units = calloc(BITMAP_ELEMENTS(nunits), sizeof(uint64_t));
+  if (!pool.idle_units || !pool.reclaimed_units)
+    return -1;
+
+  // Pages never touched aren't resident, count them as given back unless they were prefaulted
+  if (!config.prefault_pool)
+    memset(pool.reclaimed_units, 0xff, BITMAP_ELEMENTS(nunits) * sizeof(uint64_t));
+
+  pool.reclaimable = true;
+  return 0;
+}
+
+/*
+ * The units of blocks about to be used are neither idle nor given back anymore
+ */
+static inline void MP_touch(size_t bindex, size_t nblocks) {
+  if (!pool.reclaimable)
+    return;
+
+  size_t first = BLOCKS_TO_BYTES(bindex) / pool.reclaim_unit;
+  size_t last = (BLOCKS_TO_BYTES(bindex + nblocks) - 1) / pool.reclaim_unit;
+  for (size_t unit = first; unit <= last; unit++) {
+    CLEAR_UNIT(pool.idle_units, unit);
+    CLEAR_UNIT(pool.reclaimed_units, unit);
+  }
+}
+
+/*
+ * Give back to the system the pool units that stayed free since the last reclaim,
+ * merging neighbouring units into one madvise. Returns the bytes given back
+ */
+static inline size_t MP_reclaim(void) {
+  if (!pool.reclaimable)
+    return 0;
+
+  size_t unit_words = pool.reclaim_unit / BLOCKS_TO_BYTES(BITMAP_SIZE);
+  size_t nunits = (pool.npages * pagesize) / pool.reclaim_unit;
+  size_t start = 0, len = 0, reclaimed = 0;
+
+  for (size_t unit = 0; unit <= nunits; unit++) {
+    bool ready = false;
+    if (unit < nunits && !UNIT_IS_SET(pool.reclaimed_units, unit)) {
+      bool free = true;
+      for (size_t w = unit * unit_words; w < (unit + 1) * unit_words && free; w++)
+        free = (pool.freebs[w] == UINT64_MAX);
+
+      if (free && UNIT_IS_SET(pool.idle_units, unit))
+        ready = true;
+      else if (free)
+        SET_UNIT(pool.idle_units, unit);
+    }
+
+    if (ready) {
+      if (len++ == 0)
+        start = unit;
+      SET_UNIT(pool.reclaimed_units, unit);
+      continue;
+    }
+
+    if (len > 0 && madvise(pool.bpool + start * pool.reclaim_unit, len * pool.reclaim_unit, MADV_DONTNEED) == 0)
+      reclaimed += len * pool.reclaim_unit;
+    len = 0;
+  }
+
+  return reclaimed;
+}
+
 static inline int MP_init(size_t npages) {
   if (!npages)
     return -1;
-  size_t   bitmap_size, pool_size, iov_pool_size;
+  size_t   bitmap_size, pool_size;
   uint32_t cmax;
 
   /*** Setup ***/
-  pool.npages = npages;
   cmax = config.max_concurrent_clients;
-  pool_size = pool.npages * pagesize;
-  iov_pool_size = (sizeof(IOV) * MAX_SEND_IOV) * cmax;
+  pool_size = npages * pagesize;
 
   /*** Pool ***/
-  pool.bpool = new_mem(pool_size);
+  pool.bpool = MP_map(&pool_size);
   if (!pool.bpool)
     return -1;
+  pool.npages = pool_size / pagesize;
   pool.nblocks = pool_size / MP_BLOCK;
+  MP_prefault();
 
   /*** Cpool ***/
-  pool.cpool = (Conn *)malloc(sizeof(Conn) * cmax);
+  // Cache line aligned, so each slot takes exactly its two lines
+  pool.cpool = (Conn *)aligned_alloc(64, sizeof(Conn) * cmax);
   if (!pool.cpool)
     return -1;
 
-  /*** IOVpool ***/
-  pool.iovpool = (IOV *)malloc(iov_pool_size);
-  if (!pool.iovpool)
+  /*** Ccold ***/
+  pool.ccold = (ConnCold *)malloc(sizeof(ConnCold) * cmax);
+  if (!pool.ccold)
     return -1;
 
-  /*** RECpool ***/
-  pool.recpool = (IOV *)malloc(iov_pool_size);
-  if (!pool.recpool)
+  /*** Gens ***/
+  pool.gens = calloc(cmax, sizeof(uint32_t));
+  if (!pool.gens)
     return -1;
 
-  for (size_t i = 0; i < cmax; i++) {
-    pool.cpool[i].send.iov = GET_CIOV(i);
-    pool.cpool[i].send.rec = GET_CREC(i);
-  }
-
   /*** Freebs ***/
   bitmap_size = BITMAP_ELEMENTS(pool.nblocks);
   pool.freebs = malloc(sizeof(uint64_t) * bitmap_size);
@@ -78,9 +231,80 @@ static inline int MP_init(size_t npages) {
   for (size_t i = 0; i < bitmap_size; i++)
     pool.freecs[i] = UINT64_MAX;
 
+  return MP_init_reclaim();
+}
+
+/*
+ * Register the pool as fixed buffers with the ring
+ * so the kernel doesn't have to pin and map its pages again on every recv and send
+ */
+static inline int MP_register(void) {
+  IOV    iovs[MAX_FIXED_BUFS];
+  size_t pool_size = pool.npages * pagesize;
+  size_t n = (pool_size + FIXED_BUF_MAX - 1) / FIXED_BUF_MAX;
+  if (n > MAX_FIXED_BUFS)
+    return -1;
+
+  for (size_t i = 0; i < n; i++) {
+    size_t offset = i * FIXED_BUF_MAX;
+    iovs[i].iov_base = pool.bpool + offset;
+    iovs[i].iov_len = (pool_size - offset < FIXED_BUF_MAX) ? (pool_size - offset) : FIXED_BUF_MAX;
+  }
+
+  if (io_uring_register_buffers(&ring, iovs, n) < 0)
+    return -1;
+
+  pool.nfixed = n;
+  pool.fixed_send = true;
   return 0;
 }
 
+static inline size_t mem_class(size_t len) {
+  size_t npages = BYTES_TO_PAGES(len);
+  return npages <= 1 ? 0 : 64 - __builtin_clzll(npages - 1);
+}
+
+/*
+ * Map a buffer of at least len bytes outside the pool, reusing an idle one of its class when there is one
+ * Buffers larger than the largest class are mapped and unmapped as they are
+ */
+static inline void *MP_mem_get(size_t len) {
+  size_t c = mem_class(len);
+  if (c >= MEM_CLASSES)
+    return new_mem(ALIGN_TO_PAGESIZE(len));
+
+  MemClass *mc = &pool.cache[c];
+  if (mc->n > 0) {
+    pool.cache_size -= CLASS_BYTES(c);
+    stats.mem_cache_hits++;
+    stats.mem_cache_bytes = pool.cache_size;
+    return mc->bufs[--mc->n];
+  }
+
+  stats.mem_cache_misses++;
+  return new_mem(CLASS_BYTES(c));
+}
+
+/*
+ * Give back a buffer from MP_mem_get, len is the size it was asked for or its page aligned size
+ * It's kept while its class and config.mem_cache_size have room, its pages are freed lazily until it's reused
+ */
+static inline void MP_mem_put(void *mem, size_t len) {
+  size_t c = mem_class(len);
+  if (c >= MEM_CLASSES)
+    return (void)munmap(mem, ALIGN_TO_PAGESIZE(len));
+
+  size_t    bytes = CLASS_BYTES(c);
+  MemClass *mc = &pool.cache[c];
+  if (mc->n == MEM_CLASS_DEPTH || pool.cache_size + bytes > config.mem_cache_size)
+    return (void)munmap(mem, bytes);
+
+  madvise(mem, bytes, MADV_FREE);
+  mc->bufs[mc->n++] = mem;
+  pool.cache_size += bytes;
+  stats.mem_cache_bytes = pool.cache_size;
+}
+
 static inline int MP_use_blks(size_t nblocks) {
   if (!nblocks || nblocks > pool.nblocks)
     return -1;
@@ -109,6 +333,8 @@ static inline int MP_use_blks(size_t nblocks) {
       for (size_t j = 0; j < full_chunks; j += 64)
         USEBW(i + j);
 
+      pool.used_blocks += nblocks;
+      MP_touch(i, nblocks);
       return i;
     }
   }
@@ -125,57 +351,46 @@ static inline int MP_free_blks(size_t bindex, size_t nblocks) {
   for (size_t i = 0; i < full_chunks; i += BITMAP_SIZE)
     FREEBW(bindex + i);
 
-  void *blk = GET_POOL_BY_INDEX(bindex);
-  memset(blk, 0, nblocks * MP_BLOCK);
+  pool.used_blocks -= nblocks;
   return 0;
 }
 
-static inline Conn *MP_use(int fd, size_t recv_nblocks, size_t send_nblocks) {
+/*
+ * Take a connection slot with a receive buffer of recv_nblocks.
+ * The response head buffer send.rec[0] is left empty until a response is built, see MP_grow_head
+ */
+static inline Conn *MP_use(int fd, size_t recv_nblocks) {
   int cindex = find_freec();
   if (cindex < 0)
     return NULL;
 
   Conn *conn = &pool.cpool[cindex];
   memset(conn, 0, sizeof(Conn));
+  memset(&pool.ccold[cindex], 0, sizeof(ConnCold));
 
   conn->fd = fd;
-  conn->timeout.op = TIMEOUT;
-  conn->timeout.conn = conn;
-  conn->send.iov = GET_CIOV(cindex);
-  conn->send.rec = GET_CREC(cindex);
+  conn->send.iov = COLD(conn)->send.siov;
+  COLD(conn)->send.rec = COLD(conn)->send.srec;
+  COLD(conn)->send.cap = SEND_IOV;
+  conn->send.iovlen = COLD(conn)->send.reclen = 1;
 
-  void *mem, *recv_mem, *send_mem;
-  int   bindex = MP_use_blks(recv_nblocks + send_nblocks);
-  if (bindex < 0) {
-    if (config.pool_only || (mem = new_mem(recv_nblocks + send_nblocks)) == NULL)
+  if (recv_nblocks > 0) {
+    void *recv_mem;
+    int   bindex = MP_use_blks(recv_nblocks);
+    if (bindex >= 0) {
+      recv_mem = GET_POOL_BY_INDEX(bindex);
+    } else if (config.pool_only || (recv_mem = MP_mem_get(BLOCKS_TO_BYTES(recv_nblocks))) == NULL) {
+      FREEC(cindex);
       return NULL;
+    }
 
-    recv_mem = mem;
-    send_mem = mem + recv_nblocks;
-  } else {
-    recv_mem = GET_POOL_BY_INDEX(bindex);
-    send_mem = GET_POOL_BY_INDEX(bindex + recv_nblocks);
-  }
-
-  IOV *iov, *rec;
-  if (recv_nblocks > 0) {
-    rec = &conn->recv.rec[0];
-    iov = &conn->recv.iov[0];
+    IOV *rec = &COLD(conn)->recv.rec[0];
     rec->iov_base = recv_mem;
     rec->iov_len = BLOCKS_TO_BYTES(recv_nblocks);
-    memcpy(iov, rec, sizeof(IOV));
+    memcpy(&conn->recv.iov[0], rec, sizeof(IOV));
   }
 
-  if (send_nblocks > 0) {
-    conn->send.iovlen++, conn->send.reclen++;
-    rec = &conn->send.rec[0];
-    iov = &conn->send.iov[0];
-    rec->iov_base = send_mem;
-    rec->iov_len = BLOCKS_TO_BYTES(send_nblocks);
-    memcpy(iov, rec, sizeof(IOV));
-  }
-
-  conn->timeout.last_used = get_time();
+  pool.nconns++;
   return conn;
 }
 
@@ -183,91 +398,273 @@ static inline void MP_shed(IOV *rec, size_t iovlen) {
   size_t bindex, nblocks;
 
   for (size_t i = 0; i < iovlen; i++) {
-    rec = &rec[i];
-    if (!rec || !rec->iov_base)
+    IOV *iov = &rec[i];
+    if (!iov->iov_base)
       continue;
-    if (!IN_POOL(rec->iov_base)) {
-      munmap(rec->iov_base, rec->iov_len / pagesize);
+    if (!IN_POOL(iov->iov_base)) {
+      MP_mem_put(iov->iov_base, iov->iov_len);
     } else {
-      bindex = GETBI(rec->iov_base);
-      nblocks = rec->iov_len / MP_BLOCK;
+      bindex = GETBI(iov->iov_base);
+      nblocks = iov->iov_len / MP_BLOCK;
       MP_free_blks(bindex, nblocks);
     }
-    memset(rec, 0, sizeof(IOV));
+    memset(iov, 0, sizeof(IOV));
   }
 }
 
+/*
+ * Move the first used bytes of rec into a new buffer of at least len bytes
+ */
+static inline int MP_realloc(IOV *rec, size_t len, size_t used) {
+  if (!rec || !len || used > len)
+    return -1;
+
+  IOV    old = *rec;
+  size_t nblocks = round_to_blocks(len);
+  int    bindex = MP_use_blks(nblocks);
+  if (bindex < 0) {
+    void *mem;
+    if (config.pool_only || (mem = MP_mem_get(len)) == NULL)
+      return -1;
+    rec->iov_base = mem;
+    rec->iov_len = ALIGN_TO_PAGESIZE(len);
+  } else {
+    rec->iov_base = GET_POOL_BY_INDEX(bindex);
+    rec->iov_len = BLOCKS_TO_BYTES(nblocks);
+  }
+
+  if (old.iov_base) {
+    memcpy(rec->iov_base, old.iov_base, used);
+    MP_shed(&old, 1);
+  }
+
+  return 0;
+}
+
+/*
+ * Grow the pool buffer in rec in place by taking the free blocks right after it
+ */
+static inline int MP_extend(IOV *rec, size_t nblocks) {
+  if (!rec || !rec->iov_base || !IN_POOL(rec->iov_base) || !nblocks)
+    return -1;
+
+  nblocks = CEIL_BLOCKS(nblocks);
+  size_t bindex = GETBI(rec->iov_base) + (rec->iov_len / MP_BLOCK);
+  if (bindex + nblocks > pool.nblocks)
+    return -1;
+
+  for (size_t i = 0; i < nblocks; i += BITMAP_SIZE)
+    if (!BW_IS_FREE(bindex + i))
+      return -1;
+
+  for (size_t i = 0; i < nblocks; i += BITMAP_SIZE)
+    USEBW(bindex + i);
+
+  pool.used_blocks += nblocks;
+  MP_touch(bindex, nblocks);
+  rec->iov_len += BLOCKS_TO_BYTES(nblocks);
+  return 0;
+}
+
+/*
+ * Double the capacity of the send scatter list, moving it into the pool on the first call
+ */
+static inline int MP_grow_send(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  uint32_t  cap = cold->send.cap * 2;
+  IOV       meta = {0};
+  if (MP_realloc(&meta, sizeof(IOV) * cap * 2, 0) < 0)
+    return -1;
+
+  IOV *iov = (IOV *)meta.iov_base;
+  IOV *rec = iov + cap;
+  memcpy(iov, conn->send.iov, sizeof(IOV) * cold->send.cap);
+  memcpy(rec, cold->send.rec, sizeof(IOV) * cold->send.cap);
+  if (cold->send.meta.iov_base)
+    MP_shed(&cold->send.meta, 1);
+
+  cold->send.meta = meta;
+  conn->send.iov = iov;
+  cold->send.rec = rec;
+  cold->send.cap = cap;
+  return 0;
+}
+
+/*
+ * Return the next send iov, growing the scatter list if it's full
+ */
+static inline IOV *MP_next_iov(Conn *conn) {
+  if (conn->send.iovlen >= COLD(conn)->send.cap && MP_grow_send(conn) < 0)
+    return NULL;
+
+  return &conn->send.iov[conn->send.iovlen++];
+}
+
+/*
+ * Chain a new content buffer of nblocks to the response.
+ * Return the iov index on success, -1 on failure.
+ */
 static inline int MP_expand(Conn *conn, size_t nblocks, bool once) {
   if (!conn || conn->fd == -1 || !nblocks)
     return -1;
 
-  IOV  *iov, *rec;
-  void *bptr;
-  int   iov_index, bindex;
+  ConnCold *cold = COLD(conn);
 
-  iov_index = conn->send.reclen;
-  conn->send.iovlen++, conn->send.reclen++;
-  iov = &conn->send.iov[iov_index];
-  rec = &conn->send.rec[iov_index];
+  IOV   *iov, *rec;
+  void  *bptr;
+  size_t len = BLOCKS_TO_BYTES(nblocks);
+  int    bindex = -1;
 
-  if (once) {
-    bptr = new_mem(nblocks);
-    if (!bptr)
-      return -1;
-    rec->iov_base = bptr;
-    rec->iov_len = ALIGN_TO_PAGESIZE(nblocks * MP_BLOCK);
-    memcpy(iov, rec, sizeof(IOV));
-    return iov_index;
-  }
+  if (conn->send.iovlen >= cold->send.cap && MP_grow_send(conn) < 0)
+    return -1;
+
+  if (!once)
+    bindex = MP_use_blks(nblocks);
 
-  bindex = MP_use_blks(nblocks);
   if (bindex < 0) {
-    bptr = new_mem(nblocks);
-    if (!bptr)
+    if ((!once && config.pool_only) || (bptr = MP_mem_get(len)) == NULL)
       return -1;
-    iov->iov_len = ALIGN_TO_PAGESIZE(nblocks * MP_BLOCK);
-    rec->iov_len = iov->iov_len;
+    len = ALIGN_TO_PAGESIZE(len);
   } else {
-    bptr = pool.bpool + (bindex * MP_BLOCK);
-    iov->iov_len = nblocks * MP_BLOCK;
-    rec->iov_len = iov->iov_len;
+    bptr = GET_POOL_BY_INDEX(bindex);
   }
 
-  iov->iov_base = bptr;
-  rec->iov_base = iov->iov_base;
+  int iov_index = conn->send.iovlen++;
+  iov = &conn->send.iov[iov_index];
+  rec = &cold->send.rec[cold->send.reclen++];
+  rec->iov_base = bptr;
+  rec->iov_len = len;
+  memcpy(iov, rec, sizeof(IOV));
   return iov_index;
 }
 
+/*
+ * Keep the release callback of a buffer sent by reference until the response is sent
+ */
+static inline int MP_add_ref(Conn *conn, Release fn, void *ctx) {
+  ConnCold *cold = COLD(conn);
+  size_t    used = conn->send.nrefs * sizeof(Ref);
+  if (used + sizeof(Ref) > cold->send.refs.iov_len
+      && MP_realloc(&cold->send.refs, used ? (used * 2) : (sizeof(Ref) * 4), used) < 0)
+    return -1;
+
+  Ref *ref = (Ref *)cold->send.refs.iov_base + conn->send.nrefs++;
+  ref->fn = fn;
+  ref->ctx = ctx;
+  return 0;
+}
+
+static inline void MP_release_refs(Conn *conn) {
+  Ref     *refs = (Ref *)COLD(conn)->send.refs.iov_base;
+  uint32_t nrefs = conn->send.nrefs;
+
+  conn->send.nrefs = 0;
+  for (uint32_t i = 0; i < nrefs; i++)
+    refs[i].fn(refs[i].ctx);
+
+  MP_shed(&COLD(conn)->send.refs, 1);
+}
+
+/*
+ * Grow the response head buffer, from SEND_HEAD_MIN and doubling up to max_headers_size
+ * Its first used bytes are kept
+ */
+static inline int MP_grow_head(Conn *conn, size_t used) {
+  IOV   *rec = &COLD(conn)->send.rec[0];
+  size_t len = rec->iov_len ? rec->iov_len * 2 : SEND_HEAD_MIN;
+  if (rec->iov_len >= config.max_headers_size)
+    return -1;
+
+  if (MP_realloc(rec, len, used) < 0)
+    return -1;
+
+  conn->send.iov[0] = *rec;
+  return 0;
+}
+
+/*
+ * Give back the response head buffer once the response is sent, idle connections hold no send memory
+ */
+static inline void MP_release_head(Conn *conn) {
+  MP_shed(&COLD(conn)->send.rec[0], 1);
+  memset(&conn->send.iov[0], 0, sizeof(IOV));
+}
+
+/*
+ * Give back the chunks of HK_alloc
+ */
+static inline void MP_release_arena(Conn *conn) {
+  MP_shed(COLD(conn)->arena, conn->narena);
+  conn->narena = 0;
+  COLD(conn)->arena_used = 0;
+}
+
+/*
+ * Release the content buffers and the grown scatter list once a response is sent
+ */
+static inline void MP_reset_send(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  IOV       head = cold->send.rec[0];
+  if (conn->send.nrefs > 0)
+    MP_release_refs(conn);
+  if (cold->send.reclen > 1)
+    MP_shed(&cold->send.rec[1], cold->send.reclen - 1);
+
+  if (cold->send.meta.iov_base) {
+    MP_shed(&cold->send.meta, 1);
+    conn->send.iov = cold->send.siov;
+    cold->send.rec = cold->send.srec;
+    cold->send.cap = SEND_IOV;
+  }
+
+  memset(cold->send.siov, 0, sizeof(cold->send.siov));
+  memset(cold->send.srec, 0, sizeof(cold->send.srec));
+  cold->send.rec[0] = head;
+  conn->send.iov[0] = head;
+  conn->send.iovlen = cold->send.reclen = 1;
+  cold->send.path = 0;
+  cold->send.sampled = false;
+  cold->send.bytes = cold->send.start = cold->send.cpu = 0;
+}
+
+/*
+ * Release the slot of a connection torn down by uclose, once the last of its completions is in
+ */
 static inline int MP_free(Conn *conn) {
   if (!conn || conn->fd == -1)
     return -1;
 
-  size_t cindex = GETCI(conn);
-  MP_shed(conn->recv.rec, 2);
-  MP_shed(conn->send.rec, conn->send.reclen);
+  ConnCold *cold = COLD(conn);
+  size_t    cindex = GETCI(conn);
+  MP_shed(cold->recv.rec, 2);
+  MP_shed(cold->send.rec, cold->send.reclen);
+  MP_shed(&cold->send.meta, 1);
+  MP_shed(cold->scratch, NSCRATCH);
+  MP_shed(cold->arena, conn->narena);
+  MP_release_refs(conn);
   if (IS_FREEC(cindex))
     return 0;
 
-  if (conn->fd != -1)
-    close(conn->fd);
-
   FREEC(cindex);
+  pool.nconns--;
   memset(conn, 0, sizeof(Conn));
   conn->fd = -1;
+  // Completions for the slot that come later anyway carry the old generation and are dropped
+  pool.gens[cindex]++;
   return 0;
 }
 
-static inline void MP_clear(Conn *conn) {
-  if (!conn || conn->fd == -1)
-    return;
-
-  shutdown(conn->fd, SHUT_RDWR);
-  MP_free(conn);
-}
-
 static inline void MP_exit(MPool *pool) {
-  munmap(pool->bpool, pool->npages);
+  for (size_t c = 0; c < MEM_CLASSES; c++)
+    for (size_t i = 0; i < pool->cache[c].n; i++)
+      munmap(pool->cache[c].bufs[i], CLASS_BYTES(c));
+
+  munmap(pool->bpool, pool->npages * pagesize);
+  free((void *)pool->idle_units);
+  free((void *)pool->reclaimed_units);
   free((void *)pool->cpool);
+  free((void *)pool->ccold);
+  free((void *)pool->gens);
   free((void *)pool->freebs);
   free((void *)pool->freecs);
 }
@@ -2,21 +2,303 @@
 #ifndef SERV_H
 #define SERV_H
 
+#include "balance.h"
 #include "pool.h"
+#include "tls.h"
 #include "uring.h"
+#include <sys/resource.h>
 #include <sys/sysinfo.h>
 
+/*
+ * Frame the content written since the last chunk.
+ * The size line goes into dst, and the last-chunk marker is queued once the streamer is done.
+ * Return the size written into dst on success, -1 on failure.
+ */
+static inline int frame_chunk(Conn *conn, char *dst, size_t maxlen) {
+  size_t len = conn->send.len;
+  size_t res_len = 0;
+
+  if (len > 0) {
+    res_len = fmt_chunk(dst, maxlen, len, conn->stream.crlf);
+    if (!res_len)
+      return -1;
+    conn->stream.crlf = true;
+  }
+
+  if (!conn->stream.done || conn->stream.last)
+    return res_len;
+
+  if (len == 0) {
+    res_len = fmt_chunk(dst, maxlen, 0, conn->stream.crlf);
+    if (!res_len)
+      return -1;
+    conn->stream.last = true;
+  } else {
+    IOV *iov = MP_next_iov(conn);
+    if (!iov)
+      return -1;
+    iov->iov_base = LAST_CHUNK;
+    iov->iov_len = STRLEN(LAST_CHUNK);
+    conn->send.len += STRLEN(LAST_CHUNK);
+    conn->stream.last = true;
+  }
+
+  return res_len;
+}
+
+/*
+ * Send the formatted response head of res_size bytes, followed by the content
+ */
+static inline int sendmsg_head(Request *req, ResWriter *res, size_t res_size) {
+  IOV *iov, *rec;
+  rec = &COLD(current_conn)->send.rec[0];
+
+  if (res->chunked) {
+    Conn *conn = current_conn;
+    if (req->method == HEAD || !should_have_content_length(req, res)) {
+      // No content, the stream ends with the head
+      memset(&conn->send.iov[1], 0, sizeof(IOV) * (conn->send.iovlen - 1));
+      conn->send.iovlen = 1;
+      conn->send.len = 0;
+      conn->stream.done = conn->stream.last = true;
+    }
+
+    int frame_size = frame_chunk(conn, rec->iov_base + res_size, rec->iov_len - res_size);
+    if (frame_size < 0)
+      return -1;
+    res_size += frame_size;
+  }
+
+  iov = &current_conn->send.iov[0];
+  iov->iov_base = rec->iov_base;
+  iov->iov_len = res_size;
+  current_conn->send.len += res_size;
+
+  return usendmsg(current_conn, 0, current_conn->send.iovlen);
+}
+
+/*
+ * Format the response head into the head buffer of conn, growing the buffer until the head fits
+ * with RES_END_ROOM to spare. Return the head size on success, 0 on failure.
+ */
+static inline size_t fmt_head(Conn *conn, ResWriter *res) {
+  while (true) {
+    IOV *rec = &COLD(conn)->send.rec[0];
+    if (rec->iov_base) {
+      size_t head_size = fmt_res_head(res, rec->iov_base, rec->iov_len);
+      if (!head_size)
+        return 0;
+      if (head_size + RES_END_ROOM <= rec->iov_len)
+        return head_size;
+    }
+
+    if (MP_grow_head(conn, 0) < 0)
+      return 0;
+  }
+}
+
+/*
+ * Format the HTTP response and send it
+ */
+static inline int sendmsg_res(Request *req, ResWriter *res) {
+  size_t head_size = fmt_head(current_conn, res);
+  if (!head_size)
+    return -1;
+
+  IOV   *rec = &COLD(current_conn)->send.rec[0];
+  size_t end_size = fmt_res_end(req, res, rec->iov_base + head_size, rec->iov_len - head_size);
+  if (!end_size)
+    return -1;
+
+  return sendmsg_head(req, res, head_size + end_size);
+}
+
+/*
+ * Tear conn down, through the ring unless the submission queue is full.
+ * The slot is released with the last completion of the connection, see handle_cqe,
+ * so no completion still in flight can land on it once it's reused
+ */
+static inline void close_conn(Conn *conn) {
+  if (!conn || conn->fd == -1 || conn->closing)
+    return;
+
+  ConnCold *cold = COLD(conn);
+  conn->closing = true;
+  cold->closed = clock_ns(CLOCK_MONOTONIC);
+  tls_free(conn);
+  if (uclose(conn) < 0) {
+    if (!conn->handoff)
+      shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+    if (cold->body.pipe[0] > 0) {
+      close(cold->body.pipe[0]);
+      close(cold->body.pipe[1]);
+    }
+  }
+
+  cold->body.pipe[0] = cold->body.pipe[1] = 0;
+  if (!conn->inflight)
+    MP_free(conn);
+}
+
+/*
+ * Answer a connection there is no room for without reading its request
+ */
+static inline void reject_conn(int connfd) {
+  // Accepted blocking, see umaccept. A client that doesn't read must not stall the worker,
+  // and a new socket has no other status flags to keep
+  fcntl(connfd, F_SETFL, O_NONBLOCK);
+  send(connfd, RES_OVERLOADED, STRLEN(RES_OVERLOADED), MSG_NOSIGNAL);
+  close(connfd);
+  stats.rejected++;
+}
+
+/*
+ * Reject the request of conn, the response is static and goes out ahead of the close, see usend_last
+ */
+static inline int send_overloaded(Conn *conn) {
+  stats.rejected++;
+  return usend_last(conn, RES_OVERLOADED, STRLEN(RES_OVERLOADED));
+}
+
+/*
+ * Whether free connection slots, or pool blocks when the pool is all there is, are down to mult/ADMIT_LOW_DIV
+ */
+static inline bool low_on_room(size_t mult) {
+  size_t free_conns = config.max_concurrent_clients - pool.nconns;
+  size_t free_blocks = pool.nblocks - pool.used_blocks;
+
+  if (free_conns <= mult * config.max_concurrent_clients / ADMIT_LOW_DIV)
+    return true;
+
+  return config.pool_only && free_blocks <= mult * pool.nblocks / ADMIT_LOW_DIV;
+}
+
+/*
+ * Pause accepting when running low on room, leaving new connections in the listen backlog,
+ * and resume once there is twice as much room so it doesn't flap
+ */
+static inline void admit_conns(void) {
+  if (!pool.accept_paused && low_on_room(1)) {
+    pool.accept_paused = true;
+    stats.accept_pauses++;
+    if (pool.accept_armed)
+      ucancel_accept();
+  } else if (pool.accept_paused && !low_on_room(2)) {
+    pool.accept_paused = false;
+  }
+
+  if (!pool.accept_paused && !pool.accept_backoff && !pool.accept_armed)
+    umaccept(pool.listenfd);
+}
+
+static inline uint32_t isqrt(uint32_t n) {
+  uint32_t root = 0;
+  for (uint32_t bit = 1u << 30; bit; bit >>= 2) {
+    if (n >= root + bit) {
+      n -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+  }
+
+  return root;
+}
+
+/*
+ * Admit each request of conn by how long it queued since the receive of its head was armed, CoDel style.
+ * Once the delay stays above the target for an interval, requests are rejected at a rate growing
+ * with the square root of the rejections so far, until the delay drops below the target
+ */
+static inline bool admit_req(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+
+  // Waiting before the server was last idle is the client's, not the queue's
+  uint64_t now = clock_ns(CLOCK_MONOTONIC);
+  uint64_t delay = now - (cold->recv.armed > codel.idle ? cold->recv.armed : codel.idle);
+  stats.queue_delay_ns = EWMA(stats.queue_delay_ns, delay);
+  if (!config.queue_target_ms)
+    return true;
+
+  uint64_t target = config.queue_target_ms * 1000000ULL;
+  uint64_t interval = config.queue_interval_ms * 1000000ULL;
+  if (delay < target) {
+    codel.above_until = 0;
+    codel.dropping = false;
+    return true;
+  }
+
+  if (!codel.above_until) {
+    codel.above_until = now + interval;
+    return true;
+  }
+
+  if (!codel.dropping) {
+    if (now < codel.above_until)
+      return true;
+
+    codel.dropping = true;
+    codel.count = 0;
+    codel.drop_next = now;
+  }
+
+  if (now < codel.drop_next)
+    return true;
+
+  codel.count++;
+  codel.drop_next = now + interval / isqrt(codel.count);
+  return false;
+}
+
+/*
+ * Move the TLS handshake of conn on, and start receiving its first request once it's done
+ */
+static inline int handle_handshake(Conn *conn) {
+  int res = tls_handshake(conn);
+  if (res < 0)
+    stats.tls_failed++;
+  if (res <= 0)
+    return res;
+
+  stats.tls_handshakes++;
+  return ufrecv(conn);
+}
+
 static inline void new_conn(int connfd) {
   if (connfd <= 0)
     return;
 
   size_t nblocks = round_to_blocks(config.max_headers_size);
-  current_conn = MP_use(connfd, nblocks, nblocks);
+  current_conn = MP_use(connfd, nblocks);
   if (!current_conn)
-    return (void)close(connfd);
+    return reject_conn(connfd);
+
+  COLD(current_conn)->accepted = clock_ns(CLOCK_MONOTONIC);
+  if (tls_ctx) {
+    if (tls_accept(current_conn) < 0 || handle_handshake(current_conn) < 0)
+      return close_conn(current_conn);
+  } else if (ufrecv(current_conn) < 0) {
+    return close_conn(current_conn);
+  }
+}
 
-  if (ufrecv(current_conn) < 0 || (pool.timeout > 0 && utimeout(current_conn) < 0))
-    return MP_clear(current_conn);
+static inline void handle_accept(int res, uint32_t flags) {
+  if (res > 0)
+    new_conn(res);
+
+  // The multi-shot accept ended, it was cancelled or failed, admit_conns arms it again
+  if (!(flags & IORING_CQE_F_MORE))
+    pool.accept_armed = false;
+
+  // Out of file descriptors or memory, accepting again right away would only fail again
+  if ((res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) && !pool.accept_backoff
+      && utimer(ACCEPT_RETRY, ACCEPT_BACKOFF_MS) >= 0) {
+    pool.accept_backoff = true;
+    stats.accept_pauses++;
+    if (pool.accept_armed)
+      ucancel_accept();
+  }
 }
 
 static inline int resubmit_sendmsg(Conn *conn, int res) {
@@ -26,10 +308,10 @@ static inline int resubmit_sendmsg(Conn *conn, int res) {
   IOV   *iov;
   size_t nbytes = res;
   size_t iov_index = 0;
-  while (conn->send.iov[iov_index].iov_base == NULL)
+  while (iov_index < conn->send.iovlen && conn->send.iov[iov_index].iov_len == 0)
     iov_index++;
 
-  for (size_t i = iov_index; nbytes > 0; i++) {
+  for (size_t i = iov_index; nbytes > 0 && i < conn->send.iovlen; i++) {
     iov = &conn->send.iov[i];
 
     if (nbytes >= iov->iov_len) {
@@ -40,36 +322,200 @@ static inline int resubmit_sendmsg(Conn *conn, int res) {
 
     iov->iov_base += nbytes;
     iov->iov_len -= nbytes;
-    iov_index = i;
     break;
   }
 
+  while (iov_index < conn->send.iovlen && conn->send.iov[iov_index].iov_len == 0)
+    iov_index++;
+
   return usendmsg(conn, iov_index, conn->send.iovlen - iov_index);
 }
 
-static inline int handle_sendmsg_complete(Conn *conn) {
-  if (!conn || conn->fd == -1)
+/*
+ * Run the streamer for the next chunk and send it
+ */
+static inline int sendmsg_chunk(Conn *conn) {
+  if (!conn || conn->fd == -1 || !conn->stream.active)
     return -1;
 
+  ConnCold *cold = COLD(conn);
+
   IOV *iov, *rec;
+  current_conn = conn;
+  current_req = NULL;
+  conn->send.len = 0;
+
+  if (!conn->stream.done) {
+    // Nothing written would frame the last chunk, so asking to be called again with it is an error
+    int res = cold->stream.fn(cold->stream.ctx);
+    if (res < 0 || (res > 0 && conn->send.len == 0))
+      return -1;
+    if (res == 0)
+      conn->stream.done = true;
+  }
+
+  // The scatter list may move while framing, so iov is only taken after it
+  rec = &cold->send.rec[0];
+  int frame_size = frame_chunk(conn, rec->iov_base, rec->iov_len);
+  if (frame_size < 0)
+    return -1;
 
-  MP_shed(&conn->send.rec[1], conn->send.reclen - 1);
-  conn->send.reclen = 1;
-  memset(conn->send.iov, 0, sizeof(IOV) * conn->send.iovlen);
-  conn->send.iovlen = conn->send.reclen;
   iov = &conn->send.iov[0];
-  rec = &conn->send.rec[0];
-  memcpy(iov, rec, sizeof(IOV));
+  iov->iov_base = rec->iov_base;
+  iov->iov_len = frame_size;
+  conn->send.len += frame_size;
+  return usendmsg(conn, 0, conn->send.iovlen);
+}
 
-  MP_shed(&conn->recv.rec[1], 1);
-  memset(conn->recv.iov, 0, sizeof(IOV));
-  iov = &conn->recv.iov[0];
-  rec = &conn->recv.rec[0];
-  memcpy(iov, rec, sizeof(IOV));
+/*
+ * Add an op of bytes, submitted at start and costing cpu to submit, to the stats of its path
+ */
+static inline void record_cost(PathStats *path, uint64_t bytes, uint64_t start, uint64_t cpu) {
+  path->ops++;
+  path->bytes += bytes;
+  if (!bytes || !start)
+    return;
 
+  uint64_t kbs = (bytes + KB - 1) / KB;
+  path->cpu_ns_per_kb = EWMA(path->cpu_ns_per_kb, cpu / kbs);
+  path->lat_ns_per_kb = EWMA(path->lat_ns_per_kb, (clock_ns(CLOCK_MONOTONIC) - start) / kbs);
+}
+
+/*
+ * Measure the round that was just sent, and once both paths have enough samples near the
+ * zero-copy threshold move it toward the one that costs less CPU per KB on this machine
+ */
+static inline void adapt_send(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  bool zc = (cold->send.path == SENDMSGZC);
+  if (!cold->send.path)
+    return;
+
+  if (!cold->send.sampled) {
+    record_cost((zc) ? &stats.zc : &stats.copy, cold->send.bytes, 0, 0);
+    return;
+  }
+
+  record_cost((zc) ? &stats.zc : &stats.copy, cold->send.bytes, cold->send.start, cold->send.cpu);
+  if (++tune.samples[zc] < SEND_SAMPLES || tune.samples[!zc] < SEND_SAMPLES)
+    return;
+  tune.samples[0] = tune.samples[1] = 0;
+
+  PathStats *copy = &stats.copy, *zcs = &stats.zc;
+  if (zcs->cpu_ns_per_kb * 8 < copy->cpu_ns_per_kb * 7 && zcs->lat_ns_per_kb <= copy->lat_ns_per_kb * 2
+      && stats.zc_threshold > ZC_MIN_RES) {
+    stats.zc_threshold /= 2;
+    stats.zc_threshold_reason = "zero-copy used less CPU near the threshold";
+  } else if (copy->cpu_ns_per_kb * 8 < zcs->cpu_ns_per_kb * 7 && stats.zc_threshold < ZC_MAX_RES) {
+    stats.zc_threshold *= 2;
+    stats.zc_threshold_reason = "copying used less CPU near the threshold";
+  } else if (zcs->lat_ns_per_kb > copy->lat_ns_per_kb * 2 && stats.zc_threshold < ZC_MAX_RES) {
+    stats.zc_threshold *= 2;
+    stats.zc_threshold_reason = "zero-copy took over twice as long to complete";
+  } else {
+    return;
+  }
+
+  stats.zc_threshold_changes++;
+}
+
+/*
+ * Release what the sent response held and get ready for the next request
+ */
+static inline void finish_res(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  conn->recv.idle = true;
+  MP_release_head(conn);
+  MP_release_arena(conn);
+  memset(&conn->stream, 0, sizeof(conn->stream));
+  memset(&cold->stream, 0, sizeof(cold->stream));
+
+  MP_shed(&cold->recv.rec[1], 1);
+  memset(conn->recv.iov, 0, sizeof(IOV) * 2);
+  memcpy(&conn->recv.iov[0], &cold->recv.rec[0], sizeof(IOV));
+}
+
+static inline int handle_sendmsg_complete(Conn *conn) {
+  if (!conn || conn->fd == -1)
+    return -1;
+
+  adapt_send(conn);
+  MP_reset_send(conn);
+  if (conn->stream.active && !conn->stream.last)
+    return sendmsg_chunk(conn);
+  if (conn->stream.close)
+    return -1;
+
+  finish_res(conn);
   return ufrecv(conn);
 }
 
+/*
+ * The send of a link is out, the connection is between requests
+ */
+static inline void end_link(Conn *conn) {
+  conn->recv.link = LINK_NONE;
+  adapt_send(conn);
+  MP_reset_send(conn);
+  finish_res(conn);
+}
+
+/*
+ * Completions of a send and the receive linked to it, see usendmsg.
+ * A successful send posts no completion, the receive completing means the response is out.
+ * A failed one posts its own and cancels the receive, the connection is dropped once both are in.
+ * Return true when the completion should be handled as the receive of the next request
+ */
+static inline bool handle_link(Conn *conn, int res, bool linked_recv) {
+  if (conn->recv.link == LINK_BROKEN) {
+    close_conn(conn);
+    return false;
+  }
+
+  if (!linked_recv || res == -ECANCELED) {
+    conn->recv.link = LINK_BROKEN;
+    return false;
+  }
+
+  end_link(conn);
+  return true;
+}
+
+/*
+ * The receive of conn was cancelled to hand it to another worker, see handle_rebalance.
+ * It's kept when the other worker can't take it
+ */
+static inline void handoff_conn(Conn *conn) {
+  if (send_conn(conn->handoff - 1, conn->fd) == 0) {
+    stats.handoffs_out++;
+    return close_conn(conn);
+  }
+
+  conn->handoff = 0;
+  if (conn->recv.link == LINK_ARMED)
+    end_link(conn);
+  if (ufrecv(conn) < 0)
+    close_conn(conn);
+}
+
+/*
+ * Take a kept alive connection handed over by another worker, it waits for its next request as an idle one
+ */
+static inline void adopt_conn(int fd) {
+  size_t nblocks = round_to_blocks(config.max_headers_size);
+  Conn  *conn = MP_use(fd, nblocks);
+  if (!conn) {
+    // There is no request pending, closing it is what its idle deadline would do
+    close(fd);
+    return;
+  }
+
+  conn->recv.idle = true;
+  stats.handoffs_in++;
+  if (ufrecv(conn) < 0)
+    close_conn(conn);
+}
+
 static inline int handle_sendmsg(Conn *conn, int res, bool zc) {
   if (!conn || conn->fd == -1)
     return -1;
@@ -84,44 +530,271 @@ static inline int handle_sendmsg(Conn *conn, int res, bool zc) {
   return handle_sendmsg_complete(conn);
 }
 
-static inline int find_route(Server *serv, char *bptr) {
+static inline int find_route(Server *serv, char *bptr, size_t len) {
   if (!serv || !bptr)
     return -1;
 
   Request req;
   memset(&req, 0, sizeof(Request));
-  if (read_method(&req.method, bptr) < 0)
+  if (read_req_line(&req, bptr, len, NULL, NULL) < 0)
     return -1;
 
-  char *space = strchr(bptr, ' ');
-  req.path = (space + 1);
-  space = strchr(req.path, ' ');
-  *space = '\0';
-  int route_index = match_route(serv, &req);
-  *space = ' ';
-  if (route_index == -1)
+  return match_route(serv, &req);
+}
+
+/*
+ * Format the response head while the handler headers are still valid.
+ * It's sent by sendmsg_held_res once the streamed content ends.
+ */
+static inline int hold_res(Conn *conn, Request *req, ResWriter *res, bool close) {
+  ConnCold *cold = COLD(conn);
+  size_t    head_size = fmt_head(conn, res);
+  if (!head_size)
+    return -1;
+
+  cold->body.head_len = head_size;
+  cold->body.method = req->method;
+  cold->body.status = res->status;
+  cold->body.res_chunked = res->chunked;
+  conn->stream.close = close;
+  return 0;
+}
+
+static inline int sendmsg_held_res(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  Request   req = {0};
+  ResWriter res = {0};
+  IOV      *rec = &cold->send.rec[0];
+  size_t    head_size = cold->body.head_len;
+
+  req.method = cold->body.method;
+  res.status = cold->body.status;
+  res.chunked = cold->body.res_chunked;
+  res.len = conn->send.len;
+
+  size_t end_size = fmt_res_end(&req, &res, rec->iov_base + head_size, rec->iov_len - head_size);
+  if (!end_size)
+    return -1;
+
+  current_conn = conn;
+  if (req.method == HEAD)
+    conn->send.len = 0;
+  return sendmsg_head(&req, &res, head_size + end_size);
+}
+
+/*
+ * Pass a part of the streamed content to the reader
+ */
+static inline int read_segment(Conn *conn, IOV *segment) {
+  ConnCold *cold = COLD(conn);
+  if (!cold->body.fn)
+    return 0;
+
+  current_conn = conn;
+  current_req = NULL;
+  return cold->body.fn(segment, cold->body.ctx);
+}
+
+static inline int end_body(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  if (cold->body.pipe[0] > 0) {
+    close(cold->body.pipe[0]);
+    close(cold->body.pipe[1]);
+    cold->body.pipe[0] = cold->body.pipe[1] = 0;
+  }
+
+  cold->body.active = false;
+  if (read_segment(conn, NULL) < 0)
+    return -1;
+
+  return sendmsg_held_res(conn);
+}
+
+/*
+ * Ask for the next part of the streamed content into the free half of recv.rec[1]
+ */
+static inline int recv_body(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  IOV      *rec = &cold->recv.rec[1];
+  IOV      *iov = &conn->recv.iov[1];
+  size_t    half = rec->iov_len / 2;
+
+  iov->iov_base = rec->iov_base + (cold->body.win * half);
+  iov->iov_len = half;
+  if (!cold->body.chunked) {
+    if (iov->iov_len > cold->body.left)
+      iov->iov_len = cold->body.left;
+    cold->body.left -= iov->iov_len;
+  }
+  cold->body.asked = iov->iov_len;
+
+  if (urecv(conn, iov, BRECV) < 0)
+    return -1;
+
+  return 0;
+}
+
+static inline bool body_done(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  return cold->body.chunked ? (cold->recv.chunk.state == CHUNK_DONE) : (cold->body.left == 0);
+}
+
+/*
+ * Start streaming the content to the reader, beginning with the part received with the head.
+ * The next recv goes into one half of the window while the reader works on the other.
+ */
+static inline int read_body(Conn *conn) {
+  IOV  segment = conn->recv.iov[0];
+  bool done = body_done(conn);
+
+  if (!done) {
+    if (MP_realloc(&COLD(conn)->recv.rec[1], config.body_window_size * 2, 0) < 0)
+      return -1;
+    COLD(conn)->body.win = 0;
+    if (recv_body(conn) < 0)
+      return -1;
+  }
+
+  if (segment.iov_len > 0 && read_segment(conn, &segment) < 0)
+    return -1;
+
+  return done ? end_body(conn) : 0;
+}
+
+static inline int handle_brecv(Conn *conn, int res) {
+  if (!conn || conn->fd == -1)
+    return -1;
+
+  ConnCold *cold = COLD(conn);
+  IOV       segment = {conn->recv.iov[1].iov_base, res};
+  if (cold->body.chunked) {
+    long decoded = decode_chunks(conn, segment.iov_base, segment.iov_base, res);
+    if (decoded < 0)
+      return -1;
+    segment.iov_len = decoded;
+  } else {
+    cold->body.left += cold->body.asked - res;
+  }
+  cold->body.asked = 0;
+
+  bool done = body_done(conn);
+  if (!done) {
+    cold->body.win ^= 1;
+    if (recv_body(conn) < 0)
+      return -1;
+  }
+
+  if (segment.iov_len > 0 && read_segment(conn, &segment) < 0)
+    return -1;
+
+  return done ? end_body(conn) : 0;
+}
+
+static inline int splice_in(Conn *conn) {
+  size_t len = COLD(conn)->body.left;
+  if (len > config.body_window_size)
+    len = config.body_window_size;
+
+  return usplice(conn, conn->fd, COLD(conn)->body.pipe[1], len, SPLICEIN);
+}
+
+/*
+ * Start moving the content into the splice fd, beginning with the part received with the head.
+ * The rest goes from the socket through the pipe without being copied into userspace.
+ */
+static inline int splice_body(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  if (pipe2(cold->body.pipe, O_CLOEXEC) < 0) {
+    cold->body.pipe[0] = cold->body.pipe[1] = 0;
+    return -1;
+  }
+  fcntl(cold->body.pipe[1], F_SETPIPE_SZ, config.body_window_size);
+
+  if (conn->recv.iov[0].iov_len > 0)
+    return uwrite(conn, cold->body.fd, &conn->recv.iov[0]);
+
+  if (body_done(conn))
+    return end_body(conn);
+
+  return splice_in(conn);
+}
+
+static inline int handle_bwrite(Conn *conn, int res) {
+  if (!conn || conn->fd == -1)
     return -1;
 
-  return route_index;
+  IOV *iov = &conn->recv.iov[0];
+  iov->iov_base += res;
+  iov->iov_len -= res;
+  if (iov->iov_len > 0)
+    return uwrite(conn, COLD(conn)->body.fd, iov);
+
+  if (body_done(conn))
+    return end_body(conn);
+
+  return splice_in(conn);
+}
+
+static inline int handle_splicein(Conn *conn, int res) {
+  if (!conn || conn->fd == -1)
+    return -1;
+
+  ConnCold *cold = COLD(conn);
+  record_cost(&stats.splice, res, cold->body.start, cold->body.cpu);
+  cold->body.left -= res;
+  cold->body.piped = res;
+  return usplice(conn, cold->body.pipe[0], cold->body.fd, cold->body.piped, SPLICEOUT);
+}
+
+static inline int handle_spliceout(Conn *conn, int res) {
+  if (!conn || conn->fd == -1)
+    return -1;
+
+  ConnCold *cold = COLD(conn);
+  record_cost(&stats.splice, res, cold->body.start, cold->body.cpu);
+  cold->body.piped -= res;
+  if (cold->body.piped > 0)
+    return usplice(conn, cold->body.pipe[0], cold->body.fd, cold->body.piped, SPLICEOUT);
+
+  if (body_done(conn))
+    return end_body(conn);
+
+  return splice_in(conn);
+}
+
+/*
+ * Send the response written by the handler, or hold it while the request content is streamed
+ */
+static inline int end_handler(Conn *conn, Request *req, ResWriter *res) {
+  bool close = conn->recv.close;
+  if (COLD(conn)->body.active)
+    return hold_res(conn, req, res, close);
+
+  res->len = conn->send.len;
+  if (req->method == HEAD)
+    conn->send.len = 0;
+  if (sendmsg_res(req, res) < 0)
+    return -1;
+
+  if (res->chunked) {
+    // The connection stays open until the last chunk is sent
+    conn->stream.close = close;
+    return 0;
+  }
+
+  return close ? -1 : 0;
 }
 
 static inline int run_handler(Server *serv, Conn *conn) {
   if (!serv || !conn || conn->fd == -1)
     return -1;
 
-  Param   params[config.max_nparams];
-  Header  headers[config.max_nheaders];
   Request req;
   memset(&req, 0, sizeof(Request));
-  req.params = (Param *)params;
-  req.headers = (Header *)headers;
-
   ResWriter res = {0};
-  Header    resHeaders[config.max_nheaders];
-  res.headers = (Header *)resHeaders;
-
-  if (read_req(&req, (char *)conn->recv.rec[0].iov_base) < 0)
+  if (read_req(&req, (char *)COLD(conn)->recv.rec[0].iov_base, conn->recv.head_len) < 0)
     return -1;
+  req.port = conn->recv.port;
 
   int route_index = match_route(serv, &req);
   if (route_index == -1) {
@@ -131,7 +804,7 @@ static inline int run_handler(Server *serv, Conn *conn) {
 
   current_req = &req;
   conn->send.len = 0;
-  
+
   bool uses_body = serv->routes[route_index].uses_body;
   bool has_body = conn->recv.len > 0;
   if (uses_body && has_body) {
@@ -151,28 +824,126 @@ static inline int run_handler(Server *serv, Conn *conn) {
     req.body.len = conn->recv.len;
   }
   serv->routes[route_index].handler(&req, &res);
-  res.len = conn->send.len;
-  if (sendmsg_res(&req, &res) < 0)
+
+  int ret = end_handler(conn, &req, &res);
+  MP_shed(COLD(conn)->scratch, NSCRATCH);
+  return ret;
+}
+
+/*
+ * Decode the chunked content received at the end of iov and ask for the rest.
+ * The header buffer is used until it's full, then the content moves to recv.rec[1] which grows on demand.
+ */
+static inline int recv_chunks(Server *serv, Conn *conn, IOV *iov, size_t len) {
+  ConnCold *cold = COLD(conn);
+  char *dst = (char *)iov->iov_base + iov->iov_len;
+  long  decoded = decode_chunks(conn, dst, dst, len);
+  if (decoded < 0) {
+    send_empty_res(STATUSBADREQUEST);
+    return -1;
+  }
+  iov->iov_len += decoded;
+  conn->recv.len += decoded;
+
+  uint64_t max_size = serv->config.max_req_body_size;
+  if (conn->recv.len > max_size || cold->recv.chunk.size > max_size - conn->recv.len) {
+    send_empty_res(STATUSCONTENTTOOLARGE);
     return -1;
+  }
+
+  if (cold->recv.chunk.state == CHUNK_DONE)
+    return run_handler(serv, conn);
+
+  IOV *rec = &cold->recv.rec[1];
+  IOV  next;
+  if (!rec->iov_base) {
+    iov = &conn->recv.iov[0];
+    next.iov_base = (char *)iov->iov_base + iov->iov_len;
+    next.iov_len = ((char *)cold->recv.rec[0].iov_base + cold->recv.rec[0].iov_len) - (char *)next.iov_base;
+  }
+
+  if (rec->iov_base || next.iov_len == 0) {
+    iov = &conn->recv.iov[1];
+    if (iov->iov_len == rec->iov_len) {
+      // Double the buffer, with room for the framing once it's at the limit
+      size_t size = rec->iov_len ? (rec->iov_len * 2) : config.max_headers_size;
+      if (size < iov->iov_len + cold->recv.chunk.size)
+        size = iov->iov_len + cold->recv.chunk.size;
+      if (size > max_size + config.max_headers_size)
+        size = max_size + config.max_headers_size;
+      if (size <= iov->iov_len || MP_realloc(rec, size, iov->iov_len) < 0)
+        return -1;
+      iov->iov_base = rec->iov_base;
+    }
+
+    next.iov_base = (char *)iov->iov_base + iov->iov_len;
+    next.iov_len = rec->iov_len - iov->iov_len;
+  }
 
-  int index = HK_get_header(&req, "connection");
-  if (index != -1 && strcasecmp(req.headers[index].value, "close") == 0)
+  if (urecv(conn, &next, CRECV) < 0)
     return -1;
 
   return 0;
 }
 
+static inline int handle_crecv(Server *serv, Conn *conn, int res) {
+  if (!conn || conn->fd == -1)
+    return -1;
+
+  IOV *iov = COLD(conn)->recv.rec[1].iov_base ? &conn->recv.iov[1] : &conn->recv.iov[0];
+  return recv_chunks(serv, conn, iov, res);
+}
+
+/*
+ * Run the handler as soon as the head is received, then stream the content the way it asked for
+ */
+static inline int stream_body(Server *serv, Conn *conn, char *start, size_t len, size_t body_size, bool chunked) {
+  ConnCold *cold = COLD(conn);
+  IOV      *iov = &conn->recv.iov[0];
+
+  memset(&cold->body, 0, sizeof(cold->body));
+  cold->body.active = true;
+  cold->body.chunked = chunked;
+  conn->recv.len = 0;
+  iov->iov_base = start;
+  iov->iov_len = len;
+
+  if (chunked) {
+    memset(&cold->recv.chunk, 0, sizeof(cold->recv.chunk));
+    long decoded = decode_chunks(conn, start, start, len);
+    if (decoded < 0) {
+      send_empty_res(STATUSBADREQUEST);
+      return -1;
+    }
+    iov->iov_len = decoded;
+  } else {
+    if (iov->iov_len > body_size)
+      iov->iov_len = body_size;
+    cold->body.left = body_size - iov->iov_len;
+  }
+
+  if (run_handler(serv, conn) < 0)
+    return -1;
+
+  if (cold->body.splice)
+    return splice_body(conn);
+
+  return read_body(conn);
+}
+
 static inline int handle_frecv(Server *serv, Conn *conn, int res) {
   if (!conn || conn->fd == -1)
     return -1;
 
+  ConnCold *cold = COLD(conn);
+
   IOV *iov, *rec;
 
   void  *mem;
   char  *bptr, *headEnd, *headstart;
   int    route_index;
   size_t head_size;
-  bool   uses_body;
+  bool   uses_body, streams_body, chunked;
   long   body_size;
 
   bptr = (char *)conn->recv.iov[0].iov_base;
@@ -188,18 +959,76 @@ static inline int handle_frecv(Server *serv, Conn *conn, int res) {
     return -1;
   }
 
-  route_index = find_route(serv, bptr);
+  // Admitted as soon as the head is in, before its content is received
+  if (!admit_req(conn)) {
+    send_overloaded(conn);
+    return -1;
+  }
+
+  head_size = (headEnd + 4) - bptr;
+  route_index = find_route(serv, bptr, head_size);
   if (route_index == -1) {
     send_empty_res(STATUSNOTFOUND);
     return -1;
   }
 
-  head_size = (headEnd + 4) - bptr;
-  if (have_header(headstart, (headEnd + 4), "Expect", "100-Continue"))
+  // The head is only ever parsed within its length, the buffer is not cleared between requests
+  conn->recv.head_len = head_size;
+  Header known[NKNOWN_HEADERS] = {0};
+  if (scan_headers(headstart + 2, headEnd + 4, known) < 0) {
+    send_empty_res(STATUSBADREQUEST);
+    return -1;
+  }
+
+  Header *host = &known[HEADER_HOST];
+  if (!host->key) {
+    send_empty_res(STATUSBADREQUEST);
+    return -1;
+  }
+
+  Header *connection = &known[HEADER_CONNECTION];
+  conn->recv.port = read_port(host);
+  conn->recv.close = (connection->key && slice_equ(connection->value, connection->value_len, "close"));
+
+  Header *expect = &known[HEADER_EXPECT];
+  if (expect->key && slice_equ(expect->value, expect->value_len, "100-Continue"))
     send_empty_res(STATUSCONTINUE);
 
   uses_body = serv->routes[route_index].uses_body;
-  body_size = get_content_length(headstart + 2, headEnd + 4);
+  streams_body = serv->routes[route_index].streams_body;
+  body_size = get_content_length(&known[HEADER_CONTENT_LENGTH]);
+  if (body_size < -1) {
+    send_empty_res(STATUSBADREQUEST);
+    return -1;
+  }
+
+  // Only chunked alone is decoded. Another coding, or a Content-Length too, could be framed differently by a proxy
+  Header *encoding = &known[HEADER_TRANSFER_ENCODING];
+  if (encoding->key && (body_size != -1 || !slice_equ(encoding->value, encoding->value_len, "chunked"))) {
+    send_empty_res(STATUSBADREQUEST);
+    return -1;
+  }
+  chunked = (encoding->key != NULL);
+
+  // The content of routes that don't read it isn't received, so the rest of it can't be taken for the next request
+  if (!uses_body && !streams_body && (chunked || (body_size > 0 && (size_t)res < head_size + body_size))) {
+    conn->recv.close = true;
+    chunked = false;
+  }
+
+  // Streamed content is never buffered, so it's not limited by max_req_body_size
+  if (streams_body && (body_size > 0 || chunked))
+    return stream_body(serv, conn, bptr + head_size, res - head_size, body_size, chunked);
+
+  if (chunked) {
+    conn->recv.len = 0;
+    memset(&cold->recv.chunk, 0, sizeof(cold->recv.chunk));
+    iov = &conn->recv.iov[0];
+    iov->iov_base = bptr + head_size;
+    iov->iov_len = 0;
+    return recv_chunks(serv, conn, iov, res - head_size);
+  }
+
   if (body_size == -1) {
     if (((headEnd + 4) - bptr) == res || !uses_body) {
       body_size = 0;
@@ -228,9 +1057,9 @@ static inline int handle_frecv(Server *serv, Conn *conn, int res) {
   conn->recv.len = body_size - iov->iov_len;
   size_t nblocks = round_to_blocks(conn->recv.len);
   bool   once = (!config.pool_only && ((size_t)body_size > (size_t)((pool.nblocks * MP_BLOCK) / 10)));
-  rec = &conn->recv.rec[1];
+  rec = &cold->recv.rec[1];
   if (once) {
-    void *mem = new_mem(conn->recv.len);
+    void *mem = MP_mem_get(conn->recv.len);
     if (!mem)
       return -1;
 
@@ -239,11 +1068,11 @@ static inline int handle_frecv(Server *serv, Conn *conn, int res) {
   } else {
     int bindex = MP_use_blks(nblocks);
     if (bindex < 0) {
-      if (config.pool_only || (mem = new_mem(conn->recv.len)) == NULL)
+      if (config.pool_only || (mem = MP_mem_get(conn->recv.len)) == NULL)
         return -1;
 
       rec->iov_base = mem;
-      rec->iov_len = ALIGN_TO_PAGESIZE(conn->recv.len) * pagesize;
+      rec->iov_len = ALIGN_TO_PAGESIZE(conn->recv.len);
     } else {
       rec->iov_base = GET_POOL_BY_INDEX(bindex);
       rec->iov_len = nblocks * MP_BLOCK;
@@ -253,7 +1082,7 @@ static inline int handle_frecv(Server *serv, Conn *conn, int res) {
   iov = &conn->recv.iov[1];
   iov->iov_base = rec->iov_base;
   iov->iov_len = conn->recv.len;
-  return urecv(conn, iov);
+  return urecv(conn, iov, RECV);
 }
 
 static inline int handle_recv(Server *serv, Conn *conn, int res) {
@@ -262,24 +1091,13 @@ static inline int handle_recv(Server *serv, Conn *conn, int res) {
 
   conn->recv.len -= res;
   if (conn->recv.len == 0) {
-    conn->recv.iov[1].iov_base = conn->recv.rec[1].iov_base;
+    conn->recv.iov[1].iov_base = COLD(conn)->recv.rec[1].iov_base;
     conn->recv.len = conn->recv.iov[0].iov_len + conn->recv.iov[1].iov_len;
     return run_handler(serv, conn);
   }
 
   conn->recv.iov[1].iov_base += res;
-  return urecv(conn, &conn->recv.iov[1]);
-}
-
-static inline void handle_timeout(Conntimeout *timeout) {
-  Conn *conn = timeout->conn;
-  if (conn->fd == -1)
-    return;
-  // conn->cqe_count--;
-
-  uint64_t now = get_time();
-  if (now - timeout->last_used >= pool.timeout || utimeout(conn) < 0)
-    return MP_clear(conn);
+  return urecv(conn, &conn->recv.iov[1], RECV);
 }
 
 static inline int validate_config(ServConfig *config) {
@@ -287,7 +1105,11 @@ static inline int validate_config(ServConfig *config) {
       || config->max_nheaders == 0         // Required
       || config->max_nparams == 0          // Required
       || config->max_headers_size < KB     // Has to be at least 1KBs
+      || config->body_window_size < KB     // Has to be at least 1KBs
       || config->mem_pool_size < (KB * KB) // Has to be at least 1MB
+      || config->ring_entries == 0         // Required
+      || (config->queue_target_ms && !config->queue_interval_ms)
+      || (!config->tls_cert_file != !config->tls_key_file) // Both or neither
   )
     return -1;
 
@@ -295,17 +1117,15 @@ static inline int validate_config(ServConfig *config) {
   if (sysinfo(&info) < 0)
     return -1;
 
-  size_t free_mem, iov_len, pool_size, nblocks, conns, needed_mem;
+  size_t free_mem, pool_size, nblocks, conns, needed_mem;
 
   free_mem = info.freeram * info.mem_unit;
-  iov_len = (config->max_writes_per_handler + 1) * 2;
   pool_size = ALIGN_TO_PAGESIZE(config->mem_pool_size);
   nblocks = pool_size / MP_BLOCK;
   conns = config->max_concurrent_clients;
   needed_mem = 0;
-  needed_mem += conns * sizeof(Conn);
+  needed_mem += conns * (sizeof(Conn) + sizeof(ConnCold) + sizeof(uint32_t));
   needed_mem += pool_size;
-  needed_mem += conns * (sizeof(IOV) * iov_len);
   needed_mem += BITMAP_ELEMENTS(nblocks) * sizeof(uint64_t);
   needed_mem += BITMAP_ELEMENTS(conns) * sizeof(uint64_t);
 
@@ -315,6 +1135,107 @@ static inline int validate_config(ServConfig *config) {
   return 0;
 }
 
+/*
+ * Resident memory of the worker from /proc/self/statm, 0 if it can't be read
+ */
+static inline uint64_t read_rss(void) {
+  char buf[128];
+  int  fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 0;
+
+  buf[len] = '\0';
+  unsigned long size, resident;
+  if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+    return 0;
+
+  return (uint64_t)resident * pagesize;
+}
+
+static inline void handle_reclaim(void) {
+  struct rusage usage;
+
+  stats.reclaimed_bytes += MP_reclaim();
+  stats.rss_bytes = read_rss();
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    stats.rss_peak_bytes = (uint64_t)usage.ru_maxrss * KB;
+  if (stats.rss_bytes > stats.rss_peak_bytes)
+    stats.rss_peak_bytes = stats.rss_bytes;
+
+  utimer(RECLAIM, config.reclaim_interval_ms);
+}
+
+/*
+ * Whether conn is waiting for its next request with nothing else in flight, so it can be handed off
+ */
+static inline bool handoff_ready(Conn *conn) {
+  if (conn->closing || conn->handoff || conn->send.zc_notifs)
+    return false;
+
+  // After a linked send the receive is cancelled only once the send is out, see ucancel_recv
+  return (conn->recv.idle && conn->recv.link == LINK_NONE) || conn->recv.link == LINK_ARMED;
+}
+
+/*
+ * Hand idle kept alive connections to the least loaded worker when this one has more than its share.
+ * Their receive is cancelled first so no request bytes are read, they're sent once it completes cancelled
+ */
+static inline void handle_rebalance(void) {
+  int      peer = 0;
+  uint32_t n = pick_peer(&peer);
+
+  for (uint32_t i = 0; i < config.max_concurrent_clients && n > 0; i++) {
+    Conn *conn = &pool.cpool[i];
+    if (IS_FREEC(i) || !handoff_ready(conn))
+      continue;
+
+    if (ucancel_recv(conn) < 0)
+      break;
+    conn->handoff = peer + 1;
+    n--;
+  }
+
+  utimer(REBALANCE, config.rebalance_interval_ms);
+}
+
+/*
+ * Free the slots of connections that have been closing for over CLOSE_GRACE_MS.
+ * Their inflight count can't reach 0 once a completion of theirs was dropped, see serv_listen
+ */
+static inline void handle_sweep(void) {
+  uint64_t now = clock_ns(CLOCK_MONOTONIC);
+  uint64_t grace = CLOSE_GRACE_MS * 1000000ULL;
+
+  for (uint32_t i = 0; i < config.max_concurrent_clients; i++) {
+    Conn *conn = &pool.cpool[i];
+    if (!IS_FREEC(i) && conn->closing && now - COLD(conn)->closed >= grace)
+      MP_free(conn);
+  }
+
+  utimer(SWEEP, CLOSE_GRACE_MS);
+}
+
+/*
+ * A connection handed over by another worker, its fd came along in the control message
+ */
+static inline void handle_adopt(int res) {
+  struct cmsghdr *cmsg = (res > 0) ? CMSG_FIRSTHDR(&balance.msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    adopt_conn(fd);
+  }
+
+  // 0 once every other worker exited, the parent keeps none of the sending ends
+  if (res > 0 || res == -EINTR || res == -EAGAIN)
+    uadopt();
+}
+
 static inline int serv_init(Server *serv) {
   int listenfd;
   pagesize = sysconf(_SC_PAGESIZE);
@@ -325,176 +1246,590 @@ static inline int serv_init(Server *serv) {
   config = serv->config;
   serv->nroutes = get_nroutes(serv->routes);
 
-  pool.timeout = serv->timeout;
-  if (MP_init(BYTES_TO_PAGES(config.mem_pool_size)) < 0         // Initialize the pool
-      || io_uring_queue_init(IOURING_QUEUE_LIMIT, &ring, 0) < 0 // Initialize io_uring
-      || (listenfd = tcp_listen(serv->port)) < 0                // Create the sever socket
+  if (serv->timeout)
+    config.idle_timeout_ms = serv->timeout;
+  if (config.tls_cert_file && !tls_ctx && tls_init() < 0)
+    return -1;
+  if (MP_init(BYTES_TO_PAGES(config.mem_pool_size)) < 0 // Initialize the pool
+      || !uinit_ring(config.ring_entries)               // Initialize io_uring
+      || (listenfd = tcp_listen(serv->port)) < 0        // Create the sever socket
   )
     return -1;
 
+  fprintf(stderr, "process %d io_uring %s, %u/%u entries%s%s%s\n", getpid(), stats.ring_mode, stats.ring_sq_entries,
+          stats.ring_cq_entries, stats.ring_fd_registered ? ", registered fd" : "",
+          stats.napi_registered ? ", napi busy poll" : "", tls_ctx ? ", https with kernel tls" : "");
+
+  // Not fatal, without it the pool is used as regular memory
+  // Registered pages are pinned, so a pool that gives back its pages is left unregistered
+  if (!pool.reclaimable)
+    MP_register();
+  else if (utimer(RECLAIM, config.reclaim_interval_ms) < 0)
+    return -1;
+
+  if (balance.loads && config.rebalance_interval_ms
+      && (uadopt() < 0 || utimer(REBALANCE, config.rebalance_interval_ms) < 0))
+    return -1;
+  stats.zc_threshold = ZC_RES;
+  stats.zc_threshold_reason = "initial";
+
+  // Plain connections are accepted blocking, so the reads of registered buffers wait for the data
+  // instead of failing with EAGAIN. Nothing on the worker's thread may then block on them, see reject_conn
+  pool.listenfd = listenfd;
   return umaccept(listenfd);
 }
 
+/*
+ * Keep what the deadlines of the next receives are measured from, see op_deadline
+ */
+static inline void track_recv(Conn *conn, UOP op, int res) {
+  ConnCold *cold = COLD(conn);
+  switch (op) {
+  case FRECV:
+    conn->recv.idle = false;
+    cold->recv.body_start = clock_ns(CLOCK_MONOTONIC);
+    cold->recv.body_bytes = 0;
+    break;
+  case RECV:
+  case CRECV:
+  case BRECV:
+  case SPLICEIN:
+    cold->recv.body_bytes += res;
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Start loading what the next completion will read, while the current one is handled
+ */
+static inline void prefetch_cqe(struct io_uring_cqe *cqe) {
+  uint64_t ud = cqe->user_data;
+  uint8_t  op = UD_OP(ud);
+  if (!op || op == ACCEPT || op == ACCEPT_RETRY || op == RECLAIM || op == DEADLINE || op == REBALANCE
+      || op == SWEEP || op == ADOPT)
+    return;
+
+  // Both lines of the slot, it's what every connection completion reads
+  Conn *conn = &pool.cpool[UD_INDEX(ud)];
+  __builtin_prefetch(&pool.gens[UD_INDEX(ud)]);
+  __builtin_prefetch(conn);
+  __builtin_prefetch((char *)conn + 64);
+}
+
+/*
+ * Handle a completion by the op in its user_data.
+ * Those of connection ops are dropped without reading the Conn when the slot was freed since they were submitted
+ */
+static inline void handle_cqe(Server *serv, struct io_uring_cqe *cqe) {
+  uint64_t ud = cqe->user_data;
+  uint8_t  op = UD_OP(ud);
+  int      res = cqe->res;
+
+  switch (op) {
+  case 0:
+    return;
+  case ACCEPT:
+    handle_accept(res, cqe->flags);
+    return admit_conns();
+  case ACCEPT_RETRY:
+    pool.accept_backoff = false;
+    return admit_conns();
+  case RECLAIM:
+    return handle_reclaim();
+  case REBALANCE:
+    return handle_rebalance();
+  case SWEEP:
+    return handle_sweep();
+  case ADOPT:
+    return handle_adopt(res);
+  }
+
+  if (UD_IS_STALE(ud))
+    return;
+
+  Conn *conn = &pool.cpool[UD_INDEX(ud)];
+  if (conn->fd == -1)
+    return;
+
+  // A zero-copy send completes again with its notification, and the send of a link only when it fails
+  bool counted = !(cqe->flags & IORING_CQE_F_MORE) && !(op == SENDMSG && conn->recv.link != LINK_NONE);
+  if (counted)
+    conn->inflight--;
+  if (conn->closing) {
+    if (!conn->inflight)
+      MP_free(conn);
+    return;
+  }
+
+  if (op == DEADLINE) {
+    // Cancelled when its op completes in time. When it's missed the op completes cancelled,
+    // but a linked receive alone leaves nothing else to drop the connection
+    if (res == -ETIME) {
+      stats.deadlines_missed++;
+      close_conn(conn);
+    }
+    return;
+  }
+
+  if (op == HANDOFF) {
+    // The receive wasn't cancelled, it completes as usual and the connection stays
+    if (res < 0)
+      conn->handoff = 0;
+    return;
+  }
+
+  // Cancelled for a handoff, unless the send it was linked to failed
+  if (conn->handoff && (op == FRECV || op == LINKRECV)) {
+    if (res == -ECANCELED && conn->recv.link != LINK_BROKEN)
+      return handoff_conn(conn);
+    conn->handoff = 0;
+  }
+
+  current_conn = conn;
+  bool linked_recv = (op == LINKRECV);
+  if (conn->recv.link != LINK_NONE || linked_recv) {
+    if (!handle_link(conn, res, linked_recv))
+      return;
+    op = FRECV;
+  }
+
+  if (res > 0) {
+    track_recv(conn, op, res);
+    switch (op) {
+    case FRECV:
+      if (handle_frecv(serv, conn, res) < 0)
+        close_conn(conn);
+      break;
+    case RECV:
+      if (handle_recv(serv, conn, res) < 0)
+        close_conn(conn);
+      break;
+    case CRECV:
+      if (handle_crecv(serv, conn, res) < 0)
+        close_conn(conn);
+      break;
+    case BRECV:
+      if (handle_brecv(conn, res) < 0)
+        close_conn(conn);
+      break;
+    case BWRITE:
+      if (handle_bwrite(conn, res) < 0)
+        close_conn(conn);
+      break;
+    case SPLICEIN:
+      if (handle_splicein(conn, res) < 0)
+        close_conn(conn);
+      break;
+    case SPLICEOUT:
+      if (handle_spliceout(conn, res) < 0)
+        close_conn(conn);
+      break;
+    case SENDMSG:
+    case SENDMSGZC:
+      if (handle_sendmsg(conn, res, op == SENDMSGZC) < 0)
+        close_conn(conn);
+      break;
+    case HANDSHAKE:
+      if (handle_handshake(conn) < 0)
+        close_conn(conn);
+      break;
+    }
+  } else if (res == 0) {
+    switch (op) {
+    case SENDMSGZC:
+      if (cqe->flags & IORING_CQE_F_NOTIF) {
+        conn->send.zc_notifs--;
+        if (conn->send.zc_notifs == 0 && handle_sendmsg_complete(conn) < 0)
+          close_conn(conn);
+      }
+      break;
+    case FRECV:
+    case CRECV:
+    case BRECV:
+    case BWRITE:
+    case SPLICEIN:
+    case SPLICEOUT:
+      close_conn(conn);
+      break;
+    }
+  } else if (op == SENDMSGZC && res == -EINVAL && pool.fixed_send
+             && fixed_iovs(COLD(conn)->send.msg.msg_iov, COLD(conn)->send.msg.msg_iovlen) >= 0) {
+    // The kernel can't send from registered buffers, fall back to the regular path
+    MSG *msg = &COLD(conn)->send.msg;
+    pool.fixed_send = false;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      conn->send.zc_notifs--;
+    if (usendmsg(conn, msg->msg_iov - conn->send.iov, msg->msg_iovlen) < 0)
+      close_conn(conn);
+  } else if (res != -EAGAIN && res != -EWOULDBLOCK && res != -EINTR) {
+    close_conn(conn);
+  } else if (op != FRECV || ufrecv(conn) < 0) {
+    // Only a first receive can start over, others are part way through a request
+    close_conn(conn);
+  }
+}
+
 static inline int serv_listen(Server *serv) {
   if (serv_init(serv) < 0)
     return -1;
 
+  int res = 0;
   while (true) {
-    struct io_uring_cqe *cqe;
-    if (io_uring_wait_cqe(&ring, &cqe) < 0)
-      continue;
+    struct io_uring_cqe *cqes[CQE_BATCH];
 
-    if (!cqe->user_data) {
-      io_uring_cqe_seen(&ring, cqe);
-      continue;
+    // Completions the kernel held back while the queue was full are moved in once it's drained
+    if (io_uring_cq_has_overflow(&ring)) {
+      stats.cq_overflows++;
+      io_uring_get_events(&ring);
     }
 
-    int   res = cqe->res;
-    Conn *conn = NULL;
-    if (cqe->user_data > 100) {
-      uint8_t *op = (uint8_t *)cqe->user_data;
-      if (*op == TIMEOUT) {
-        handle_timeout((Conntimeout *)cqe->user_data);
-        io_uring_cqe_seen(&ring, cqe);
+    unsigned n = io_uring_peek_batch_cqe(&ring, cqes, CQE_BATCH);
+    // With deferred task work nothing completes until the worker asks
+    if (!n && (ring.flags & IORING_SETUP_DEFER_TASKRUN)) {
+      io_uring_get_events(&ring);
+      n = io_uring_peek_batch_cqe(&ring, cqes, CQE_BATCH);
+    }
+
+    if (!n) {
+      codel.idle = clock_ns(CLOCK_MONOTONIC);
+      int err = io_uring_wait_cqe(&ring, &cqes[0]);
+      if (err == -EBADR) {
+        // The kernel couldn't hold back some completions. The connections waiting on them are closed
+        // by their deadlines, and freed by the sweep as their inflight counts no longer reach 0
+        stats.cq_drops++;
+        if (!pool.sweeping && utimer(SWEEP, CLOSE_GRACE_MS) >= 0)
+          pool.sweeping = true;
+        continue;
+      } else if (err == -EINTR || err == -EAGAIN || err == -ETIME) {
         continue;
+      } else if (err < 0) {
+        res = -1;
+        break;
       }
-      conn = (Conn *)cqe->user_data;
-      current_conn = conn;
+      n = io_uring_peek_batch_cqe(&ring, cqes, CQE_BATCH);
     }
 
-    if (conn && conn->fd == -1) {
-      io_uring_cqe_seen(&ring, cqe);
-      continue;
-    }
+    if (pool.accept_paused)
+      admit_conns();
 
-    if (res > 0) {
-      if (cqe->user_data == ACCEPT) {
-        new_conn(res);
-      } else if (conn && conn->fd != -1) {
-        conn->timeout.last_used = get_time();
-        switch (conn->op) {
-        case FRECV:
-          if (handle_frecv(serv, conn, res) < 0)
-            MP_clear(conn);
-          break;
-        case RECV:
-          if (handle_recv(serv, conn, res) < 0)
-            MP_clear(conn);
-          break;
-        case SENDMSG:
-        case SENDMSGZC:
-          bool zc = (conn->op == SENDMSGZC);
-          if (handle_sendmsg(conn, res, zc) < 0)
-            MP_clear(conn);
-          break;
-        }
-      }
-    } else if (res == 0) {
-      if (conn && conn->fd != -1) {
-        switch (conn->op) {
-        case SENDMSGZC:
-          if (cqe->flags & IORING_CQE_F_NOTIF) {
-            conn->send.zc_notifs--;
-            if (conn->send.zc_notifs == 0 && handle_sendmsg_complete(conn) < 0)
-              MP_clear(conn);
-          }
-          break;
-        case FRECV:
-          MP_clear(conn);
-          break;
-        }
-      }
-    } else {
-      if (conn && conn->fd != -1) {
-        if (res != -EAGAIN && res != -EWOULDBLOCK && res != -EINTR)
-          MP_clear(conn);
-        else if (ufrecv(conn) < 0)
-          MP_clear(conn);
-      }
+    for (unsigned i = 0; i < n; i++) {
+      if (i + 1 < n)
+        prefetch_cqe(cqes[i + 1]);
+      handle_cqe(serv, cqes[i]);
     }
-
-    io_uring_cqe_seen(&ring, cqe);
+    io_uring_cq_advance(&ring, n);
   }
 
   io_uring_queue_exit(&ring);
   MP_exit(&pool);
-  return 0;
+  return res;
 }
 
 /*** Helper ***/
 static inline int _HK_write(void *data, size_t size) {
-  size_t nblocks;
-  int    iov_index, rec_index;
-  IOV   *iov, *rec;
-  bool   once;
-
-  if (current_req->method == HEAD) {
-    current_conn->send.len += size;
+  Conn    *conn = current_conn;
+  IOV     *iov, *rec;
+  char    *end, *rec_end;
+  size_t   room, len;
+  uint32_t reclen;
+  bool     once;
+
+  if (current_req && current_req->method == HEAD) {
+    conn->send.len += size;
     return 0;
   }
 
-  iov_index = current_conn->send.iovlen - 1;
-  rec_index = current_conn->send.reclen - 1;
-  iov = &current_conn->send.iov[iov_index];
-  rec = &current_conn->send.rec[rec_index];
-
-  if ((rec->iov_len - iov->iov_len) > size) {
-    memcpy(iov->iov_base + iov->iov_len, data, size);
-    iov->iov_len += size;
-    current_conn->send.len += size;
-
+  if (!size)
     return 0;
+
+  // Append to the last content buffer, growing it in place if the blocks after it are free
+  iov = &conn->send.iov[conn->send.iovlen - 1];
+  reclen = COLD(conn)->send.reclen;
+  rec = &COLD(conn)->send.rec[reclen - 1];
+  end = (char *)iov->iov_base + iov->iov_len;
+  rec_end = (char *)rec->iov_base + rec->iov_len;
+  if (conn->send.iovlen > 1 && reclen > 1 && (char *)iov->iov_base >= (char *)rec->iov_base && end <= rec_end) {
+    room = rec_end - end;
+    if (room < size && MP_extend(rec, round_to_blocks(size - room)) == 0)
+      room = ((char *)rec->iov_base + rec->iov_len) - end;
+
+    if (room >= size) {
+      memcpy(end, data, size);
+      iov->iov_len += size;
+      conn->send.len += size;
+      return 0;
+    }
   }
 
-  if (current_conn->send.iovlen >= config.max_writes_per_handler)
+  // Otherwise chain a new buffer, at least as large as the last one from the pool
+  len = size;
+  if (reclen > 1 && IN_POOL(rec->iov_base) && rec->iov_len > len)
+    len = rec->iov_len;
+
+  once = (!config.pool_only && len >= ((pool.npages * pagesize) / 10));
+  int iov_index = MP_expand(conn, round_to_blocks(len), once);
+  if (iov_index < 0)
     return -1;
 
-  once = (!config.pool_only && size >= ((pool.npages * pagesize) / 10));
-  nblocks = round_to_blocks(size);
-  iov_index = MP_expand(current_conn, nblocks, once);
-  iov = &current_conn->send.iov[iov_index];
+  iov = &conn->send.iov[iov_index];
   memcpy(iov->iov_base, data, size);
   iov->iov_len = size;
-  current_conn->send.len += size;
+  conn->send.len += size;
 
   return 0;
 }
 
 static inline int _HK_write_body(Request *req, size_t offset, size_t size) {
-  if (size > req->body.len || offset > req->body.len)
+  if (offset > req->body.len || size > req->body.len - offset)
     return -1;
 
-  if (current_conn->send.iovlen >= config.max_writes_per_handler)
-    return -1;
+  Conn *conn = current_conn;
+  if (current_req && current_req->method == HEAD) {
+    conn->send.len += size;
+    return 0;
+  }
 
   IOV   *siov, *riov;
   size_t off = offset;
   size_t bytes_left = size;
-  for (size_t i = 0; i < req->body.iovlen; i++) {
-    if (off > req->body.iov[i].iov_len) {
-      off -= req->body.iov[i].iov_len;
+  for (size_t i = 0; i < req->body.iovlen && bytes_left > 0; i++) {
+    riov = &req->body.iov[i];
+    if (off >= riov->iov_len) {
+      off -= riov->iov_len;
       continue;
     }
 
-    riov = &req->body.iov[i];
-    siov = &current_conn->send.iov[current_conn->send.iovlen++];
-
-    riov->iov_len -= off;
+    siov = MP_next_iov(conn);
+    if (!siov)
+      return -1;
 
     siov->iov_base = riov->iov_base + off;
+    siov->iov_len = riov->iov_len - off;
+    if (siov->iov_len > bytes_left)
+      siov->iov_len = bytes_left;
+
+    bytes_left -= siov->iov_len;
     off = 0;
+  }
 
-    if (bytes_left > riov->iov_len) {
-      bytes_left -= riov->iov_len;
-      siov->iov_len = riov->iov_len;
+  conn->send.len += size;
+  return 0;
+}
+
+static inline int _HK_writev_ref(const IOV *iov, size_t iovcnt, Release release, void *ctx) {
+  Conn *conn = current_conn;
+  if (!conn || (!iov && iovcnt > 0))
+    return -1;
+
+  uint32_t iovlen = conn->send.iovlen;
+  bool     head = (current_req && current_req->method == HEAD);
+  size_t   size = 0;
+  for (size_t i = 0; i < iovcnt; i++) {
+    size += iov[i].iov_len;
+    if (head || iov[i].iov_len == 0)
       continue;
+
+    IOV *siov = MP_next_iov(conn);
+    if (!siov) {
+      conn->send.iovlen = iovlen;
+      return -1;
     }
+    memcpy(siov, &iov[i], sizeof(IOV));
+  }
 
-    siov->iov_len = bytes_left;
-    break;
+  if (release && MP_add_ref(conn, release, ctx) < 0) {
+    conn->send.iovlen = iovlen;
+    return -1;
+  }
+
+  conn->send.len += size;
+  return 0;
+}
+
+static inline int _HK_stream(ResWriter *res, Streamer streamer, void *ctx) {
+  if (!res || !streamer || !current_conn)
+    return -1;
+
+  res->chunked = true;
+  COLD(current_conn)->stream.fn = streamer;
+  COLD(current_conn)->stream.ctx = ctx;
+  current_conn->stream.active = true;
+  return 0;
+}
+
+static inline int _HK_read_body(Request *req, BodyReader reader, void *ctx) {
+  if (!req || !reader || !current_conn)
+    return -1;
+
+  ConnCold *cold = COLD(current_conn);
+  if (!cold->body.active)
+    return -1;
+
+  cold->body.fn = reader;
+  cold->body.ctx = ctx;
+  cold->body.splice = false;
+  return 0;
+}
+
+static inline int _HK_splice_body(Request *req, int fd, BodyReader reader, void *ctx) {
+  if (!req || fd < 0 || !current_conn)
+    return -1;
+
+  ConnCold *cold = COLD(current_conn);
+  if (!cold->body.active || cold->body.chunked)
+    return -1;
+
+  cold->body.fn = reader;
+  cold->body.ctx = ctx;
+  cold->body.fd = fd;
+  cold->body.splice = true;
+  return 0;
+}
+
+static inline int _HK_get_stats(ServStats *dst) {
+  if (!dst)
+    return -1;
+
+  memcpy(dst, &stats, sizeof(ServStats));
+  return 0;
+}
+
+/*
+ * Split the request headers on first use, into an array sized to their count
+ */
+static inline int parse_lazy_headers(Request *req) {
+  if (!req->head)
+    return 0;
+
+  char *head = req->head, *end = req->head_end;
+  req->head = req->head_end = NULL;
+
+  size_t max = count_char(head, end, '\n');
+  if (max > config.max_nheaders)
+    max = config.max_nheaders;
+  if (!max)
+    return 0;
+
+  IOV *rec = &COLD(current_conn)->scratch[SCRATCH_HEADERS];
+  if (MP_realloc(rec, max * sizeof(Header), 0) < 0)
+    return -1;
+
+  int count = parse_headers(head, end, (Header *)rec->iov_base, max, req->known);
+  if (count < 0)
+    return -1;
+
+  req->headers = (Header *)rec->iov_base;
+  req->headers_count = count;
+  return 0;
+}
+
+/*
+ * Similar to parse_lazy_headers but for the url parameters
+ */
+static inline int parse_lazy_params(Request *req) {
+  if (!req->query)
+    return 0;
+
+  char *query = req->query;
+  req->query = NULL;
+
+  size_t max = count_char(query, query + req->query_len, '&') + 1;
+  if (max > config.max_nparams)
+    max = config.max_nparams;
+
+  IOV *rec = &COLD(current_conn)->scratch[SCRATCH_PARAMS];
+  if (MP_realloc(rec, max * sizeof(Param), 0) < 0)
+    return -1;
+
+  int count = parse_params(query, query + req->query_len, (Param *)rec->iov_base, max);
+  if (count < 0)
+    return -1;
+
+  req->params = (Param *)rec->iov_base;
+  req->params_count = count;
+  return 0;
+}
+
+static inline int _HK_get_header(Request *req, const char *key) {
+  if (!req || !key || !current_conn || parse_lazy_headers(req) < 0)
+    return -1;
+
+  int known = classify_header(key, strlen(key));
+  if (known >= 0)
+    return req->known[known] - 1;
+
+  return _get_pair((Pair *)req->headers, req->headers_count, key);
+}
+
+static inline int _HK_get_known_header(Request *req, KnownHeader header) {
+  if (!req || header < 0 || header >= NKNOWN_HEADERS || !current_conn || parse_lazy_headers(req) < 0)
+    return -1;
+
+  return req->known[header] - 1;
+}
+
+static inline int _HK_get_param(Request *req, const char *key) {
+  if (!req || !key || !current_conn || parse_lazy_params(req) < 0)
+    return -1;
+
+  return _get_pair((Pair *)req->params, req->params_count, key);
+}
+
+static inline void *_HK_alloc(Request *req, size_t size) {
+  Conn *conn = current_conn;
+  if (!req || !conn || !size)
+    return NULL;
+
+  // Bump allocated from the last chunk, chaining a larger one when it's full
+  size = (size + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1);
+  IOV *chunk = conn->narena ? &COLD(conn)->arena[conn->narena - 1] : NULL;
+  if (!chunk || COLD(conn)->arena_used + size > chunk->iov_len) {
+    if (conn->narena == ARENA_CHUNKS)
+      return NULL;
+
+    size_t len = chunk ? chunk->iov_len * 2 : ARENA_MIN;
+    if (len < size)
+      len = size;
+
+    chunk = &COLD(conn)->arena[conn->narena];
+    if (MP_realloc(chunk, len, 0) < 0)
+      return NULL;
+    conn->narena++;
+    COLD(conn)->arena_used = 0;
+  }
+
+  void *ptr = (char *)chunk->iov_base + COLD(conn)->arena_used;
+  COLD(conn)->arena_used += size;
+  return ptr;
+}
+
+static inline int _HK_set_header(ResWriter *res, Header header) {
+  if (!res || !current_conn || res->nheaders >= config.max_nheaders)
+    return -1;
+
+  // Lengths left as 0 are taken from the strings, so request headers can be set as they are
+  if (header.key && !header.key_len)
+    header.key_len = strlen(header.key);
+  if (header.value && !header.value_len)
+    header.value_len = strlen(header.value);
+  if (!header.key_len || !header.value_len)
+    return -1;
+
+  // The headers array grows geometrically from the pool, up to max_nheaders
+  IOV   *rec = &COLD(current_conn)->scratch[SCRATCH_RES_HEADERS];
+  size_t used = res->nheaders * sizeof(Header);
+  if (used + sizeof(Header) > rec->iov_len) {
+    size_t len = (used) ? (used * 2) : (sizeof(Header) * 8);
+    if (len > config.max_nheaders * sizeof(Header))
+      len = config.max_nheaders * sizeof(Header);
+    if (MP_realloc(rec, len, used) < 0)
+      return -1;
   }
 
-  current_conn->send.len += size;
+  res->headers = (Header *)rec->iov_base;
+  res->headers[res->nheaders++] = header;
   return 0;
 }
 
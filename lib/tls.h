@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#ifndef TLS_H
+#define TLS_H
+
+#include "types.h"
+#include "uring.h"
+
+#ifdef HK_TLS
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <unistd.h>
+
+// The ciphers the kernel can encrypt and decrypt records with
+#define TLS13_CIPHERS "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS12_CIPHERS                                                                                                 \
+  "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:"                          \
+  "ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+
+/*
+ * Whether the kernel has the tls ULP, a socket that isn't connected refuses it with ENOTCONN when it does
+ */
+static inline bool ktls_available(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+
+  int res = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+  int err = errno;
+  close(fd);
+  return res == 0 || err == ENOTCONN;
+}
+
+/*
+ * Create the TLS context of the listener from config.tls_cert_file and config.tls_key_file.
+ * Records are only ever encrypted by the kernel, so it fails without kTLS
+ */
+static inline int tls_init(void) {
+  if (!ktls_available()) {
+    fprintf(stderr, "kernel TLS is not available, the tls module has to be loaded for HTTPS\n");
+    return -1;
+  }
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (!ctx)
+    return -1;
+
+  // No session tickets, they would be written after the handshake when the socket is the kernel's
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_num_tickets(ctx, 0);
+  if (SSL_CTX_set_ciphersuites(ctx, TLS13_CIPHERS) != 1 || SSL_CTX_set_cipher_list(ctx, TLS12_CIPHERS) != 1
+      || SSL_CTX_use_certificate_chain_file(ctx, config.tls_cert_file) != 1
+      || SSL_CTX_use_PrivateKey_file(ctx, config.tls_key_file, SSL_FILETYPE_PEM) != 1
+      || SSL_CTX_check_private_key(ctx) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return -1;
+  }
+
+  tls_ctx = ctx;
+  return 0;
+}
+
+static inline void tls_free(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  if (!cold->tls)
+    return;
+
+  // The socket isn't closed with it
+  SSL_free(cold->tls);
+  cold->tls = NULL;
+}
+
+/*
+ * Start the TLS session of a new connection, the handshake is moved on by tls_handshake
+ */
+static inline int tls_accept(Conn *conn) {
+  SSL *ssl = SSL_new(tls_ctx);
+  if (!ssl)
+    return -1;
+
+  if (SSL_set_fd(ssl, conn->fd) != 1) {
+    SSL_free(ssl);
+    return -1;
+  }
+
+  SSL_set_accept_state(ssl);
+  COLD(conn)->tls = ssl;
+  return 0;
+}
+
+/*
+ * Move the handshake of conn on, as far as the socket allows without blocking, and wait on it through the ring.
+ * Once it's done OpenSSL has handed the keys of both directions to the kernel, the session is freed,
+ * and the connection is received and sent on like a plain one.
+ * Return 1 when it's done, 0 when it's waiting, -1 on failure
+ */
+static inline int tls_handshake(Conn *conn) {
+  SSL *ssl = COLD(conn)->tls;
+
+  ERR_clear_error();
+  int res = SSL_do_handshake(ssl);
+  if (res == 1) {
+    bool ktls = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    tls_free(conn);
+
+    // The socket blocks like a plain one from now on, see umaccept
+    int flags = fcntl(conn->fd, F_GETFL);
+    if (!ktls || flags < 0 || fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+      return -1;
+    return 1;
+  }
+
+  switch (SSL_get_error(ssl, res)) {
+  case SSL_ERROR_WANT_READ:
+    return (upoll(conn, POLLIN, HANDSHAKE) < 0) ? -1 : 0;
+  case SSL_ERROR_WANT_WRITE:
+    return (upoll(conn, POLLOUT, HANDSHAKE) < 0) ? -1 : 0;
+  default:
+    return -1;
+  }
+}
+
+#else
+
+static inline int tls_init(void) {
+  fprintf(stderr, "HTTPS needs Hunk built with TLS=1\n");
+  return -1;
+}
+
+static inline void tls_free(Conn *conn) {
+  (void)conn;
+}
+
+static inline int tls_accept(Conn *conn) {
+  (void)conn;
+  return -1;
+}
+
+static inline int tls_handshake(Conn *conn) {
+  (void)conn;
+  return -1;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#ifndef TOPO_H
+#define TOPO_H
+
+#include "types.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SYS_CPU "/sys/devices/system/cpu"
+
+/*
+ * A worker process and where it runs
+ */
+typedef struct Worker {
+  int cpu;
+  int node; // -1 when unknown
+} Worker;
+
+/*
+ * Parse a cpu list like "0-3,8,10-11" into set
+ */
+static inline int parse_cpu_list(const char *list, size_t len, cpu_set_t *set) {
+  const char *cur = list, *end = list + len;
+
+  CPU_ZERO(set);
+  while (cur < end && *cur != '\n' && *cur != '\0') {
+    char *next;
+    long  first = strtol(cur, &next, 10), last;
+    if (next == cur || first < 0 || first >= CPU_SETSIZE)
+      return -1;
+
+    last = first;
+    cur = next;
+    if (cur < end && *cur == '-') {
+      last = strtol(cur + 1, &next, 10);
+      if (next == cur + 1 || last < first || last >= CPU_SETSIZE)
+        return -1;
+      cur = next;
+    }
+
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, set);
+
+    if (cur < end && *cur == ',')
+      cur++;
+  }
+
+  return 0;
+}
+
+/*
+ * Read a sysfs cpu list file into set, an empty or missing file gives an empty set
+ */
+static inline int read_cpu_list(const char *path, cpu_set_t *set) {
+  char buf[1024];
+
+  CPU_ZERO(set);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len < 0)
+    return -1;
+
+  buf[len] = '\0';
+  return parse_cpu_list(buf, len, set);
+}
+
+/*
+ * The NUMA node of cpu, from the nodeN link in its sysfs directory
+ */
+static inline int cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), SYS_CPU "/cpu%d", cpu);
+
+  DIR *dir = opendir(path);
+  if (!dir)
+    return -1;
+
+  int            node = -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+
+  closedir(dir);
+  return node;
+}
+
+/*
+ * Pick the cpus to run workers on, at most max of them.
+ *
+ * These are the cpus the process is allowed to run on, narrowed to config.worker_cpus when it's set,
+ * or without the isolated cpus when it's not. With config.one_worker_per_core only the first
+ * hyperthread of each physical core is kept.
+ * Return the number of workers on success, -1 on failure.
+ */
+static inline int place_workers(Worker *workers, int max) {
+  cpu_set_t allowed, wanted;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return -1;
+
+  if (config.worker_cpus) {
+    if (parse_cpu_list(config.worker_cpus, strlen(config.worker_cpus), &wanted) < 0)
+      return -1;
+    CPU_AND(&allowed, &allowed, &wanted);
+  } else if (read_cpu_list(SYS_CPU "/isolated", &wanted) == 0) {
+    // Isolated cpus are kept for whatever they were isolated for, unless asked for by name
+    cpu_set_t rest;
+    CPU_XOR(&rest, &allowed, &wanted);
+    CPU_AND(&allowed, &allowed, &rest);
+  }
+
+  int nworkers = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && nworkers < max; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+
+    if (config.one_worker_per_core) {
+      char      path[96];
+      cpu_set_t siblings;
+      snprintf(path, sizeof(path), SYS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+      if (read_cpu_list(path, &siblings) == 0) {
+        // Its siblings won't get a worker, the core is taken
+        CPU_CLR(cpu, &siblings);
+        CPU_XOR(&wanted, &allowed, &siblings);
+        CPU_AND(&allowed, &allowed, &wanted);
+      }
+    }
+
+    workers[nworkers].cpu = cpu;
+    workers[nworkers].node = cpu_node(cpu);
+    nworkers++;
+  }
+
+  return nworkers > 0 ? nworkers : -1;
+}
+
+/*
+ * Run the calling worker on its cpu and prefer memory from its node, so the pool it maps is local
+ */
+static inline int bind_worker(Worker *worker) {
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(worker->cpu, &cpuset);
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) < 0)
+    return -1;
+
+  if (worker->node < 0 || worker->node >= CPU_SETSIZE)
+    return 0;
+
+  // Preferred rather than bound, a full node falls back to the others instead of failing
+  unsigned long nodemask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {0};
+  nodemask[worker->node / (8 * sizeof(unsigned long))] |= 1UL << (worker->node % (8 * sizeof(unsigned long)));
+  syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, CPU_SETSIZE + 1);
+  return 0;
+}
+
+#endif
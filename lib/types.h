@@ -5,7 +5,9 @@
 #include "hunk.h"
 #include "liburing.h"
 
-#define IOURING_QUEUE_LIMIT (4096)
+// Completions a connection can have pending at once: its op and deadline, a zero-copy notification,
+// and a linked receive with its deadline, or its teardown along with them, see uclose
+#define CQES_PER_CONN (8)
 
 #define DEF_HTTP_PORT    (80)  // Default http port
 #define DEF_HTTP_TLCPORT (443) // Default https port
@@ -13,8 +15,61 @@
 #define MP_BLOCK    (4)
 #define BITMAP_SIZE (64)
 
+#define SEND_IOV (2) // The send iovs kept in the Conn, enough for the head and one content buffer
+
+#define SEND_HEAD_MIN (512) // The response head buffer starts at this size and doubles up to max_headers_size
+#define RES_END_ROOM  (64)  // Room kept after the response head for its end and the first chunk size line
+
+// Responses up to this size, with no references or HK_alloc memory, link the next receive to their send
+#define LINK_MAX_RES (KB * 16)
+
+#define CQE_BATCH (32) // Completions taken from the ring at a time
+
+#define ACCEPT_BACKOFF_MS (100) // Accepting waits this long after running out of file descriptors or memory
+
+// Once the kernel has dropped completions, connections closing for this long are freed without their last ones
+#define CLOSE_GRACE_MS (5000)
+
+// A multi_core worker hands connections off when it has over 1/REBALANCE_SLACK_DIV more than the average,
+// at most HANDOFF_MAX at a time
+#define REBALANCE_SLACK_DIV (8)
+#define HANDOFF_MAX         (64)
+
+// HK_alloc chunks start at ARENA_MIN and double, or fit the allocation, up to ARENA_CHUNKS of them
+#define ARENA_MIN    (KB * 4)
+#define ARENA_CHUNKS (16)
+#define ARENA_ALIGN  (16)
+
 #define KB     (1024)
-#define ZC_RES (KB * 64)
+#define ZC_RES (KB * 64) // The initial zero-copy threshold, it moves between ZC_MIN_RES and ZC_MAX_RES
+#define ZC_MIN_RES (KB * 4)
+#define ZC_MAX_RES (KB * KB)
+// Zero-copy is cheaper when sending from the registered pool, so it starts at smaller responses
+#define ZC_FIXED_DIV (4)
+
+#define SEND_PROBE_RATE (16) // One in this many responses near the threshold is sent on the other path
+#define SEND_SAMPLES    (32) // Samples of each path near the threshold before it can move
+
+// Accepting pauses when free slots or blocks drop to 1/ADMIT_LOW_DIV and resumes above twice that
+#define ADMIT_LOW_DIV (16)
+// Sent as it is to requests rejected under load
+#define RES_OVERLOADED "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+#define EWMA(avg, x) ((avg) ? ((avg) - ((avg) >> 3) + ((x) >> 3)) : (x))
+// The kernel limits each registered buffer to 1GB, larger pools are registered in slices
+#define FIXED_BUF_MAX  (KB * KB * KB)
+#define MAX_FIXED_BUFS (16)
+
+// Huge page sizes the pool can be mapped with, see ServConfig.huge_pages
+#define HUGE_2MB (KB * KB * 2)
+#define HUGE_1GB (KB * KB * KB)
+
+// Buffers mapped outside the pool are recycled in classes of 2^n pages, up to MEM_CLASSES - 1
+#define MEM_CLASSES     (16)
+#define MEM_CLASS_DEPTH (8) // Idle buffers kept per class
+#define CLASS_BYTES(c)  ((size_t)pagesize << (c))
+
+#define LAST_CHUNK "\r\n0\r\n\r\n" // Closes the previous chunk and ends the content
 
 #define STRLEN(s)      (sizeof(s) - 1)
 #define PTR_DIFF(x, y) ((ptr_diff((uintptr_t)x, (uintptr_t)y)))
@@ -25,6 +80,17 @@
 
 #define GETBI(ptr) (PTR_DIFF(ptr, pool.bpool) / MP_BLOCK)
 #define GETCI(ptr) (PTR_DIFF(ptr, pool.cpool) / sizeof(Conn))
+#define COLD(conn) (&pool.ccold[(conn) - pool.cpool])
+
+// The user_data of a connection op: the op, the generation of the slot and its index.
+// A completion from before the slot was reused has an older generation and is dropped without reading the Conn
+#define UD_GEN_MASK         (0xffffffULL)
+#define UD(op, cindex, gen) (((uint64_t)(op) << 56) | (((uint64_t)(gen) & UD_GEN_MASK) << 32) | (uint32_t)(cindex))
+#define UD_OP(ud)           ((uint8_t)((ud) >> 56))
+#define UD_GEN(ud)          ((uint32_t)(((ud) >> 32) & UD_GEN_MASK))
+#define UD_INDEX(ud)        ((uint32_t)(ud))
+#define UD_IS_STALE(ud)     (UD_GEN(ud) != (pool.gens[UD_INDEX(ud)] & UD_GEN_MASK))
+#define CONN_UD(conn, op)   (UD((op), (conn) - pool.cpool, pool.gens[(conn) - pool.cpool]))
 
 #define GETCW(cindex)      (pool.freecs[(cindex) / BITMAP_SIZE])
 #define USEC(cindex)       (MARK_BIT_USED(GETCW(cindex), (cindex)))
@@ -35,17 +101,19 @@
 #define CW_IS_FREE(cindex) (GETCW((cindex)) == UINT64_MAX)
 #define CW_IS_USED(cindex) (GETCW((cindex)) == 0)
 
-#define MAX_SEND_IOV       (config.max_writes_per_handler + 1)
-#define GET_CIOV(cindex)   (&pool.iovpool[(cindex)*MAX_SEND_IOV])
-#define GET_CREC(cindex)   (&pool.recpool[(cindex)*MAX_SEND_IOV])
 #define GETBW(bindex)      (pool.freebs[(bindex) / BITMAP_SIZE])
 #define FREEBW(bindex)     (GETBW((bindex)) = UINT64_MAX)
 #define USEBW(bindex)      (GETBW((bindex)) = 0)
 #define BW_IS_FREE(bindex) (GETBW((bindex)) == UINT64_MAX)
 #define BW_IS_USED(bindex) (GETBW((bindex)) == 0)
 
+// Pool units, pages or huge pages, that stayed free for a reclaim interval and those given back
+#define UNIT_IS_SET(map, unit) (BIT_IS_FREE((map)[(unit) / BITMAP_SIZE], (unit) % BITMAP_SIZE))
+#define SET_UNIT(map, unit)    (MARK_BIT_FREE((map)[(unit) / BITMAP_SIZE], (unit) % BITMAP_SIZE))
+#define CLEAR_UNIT(map, unit)  (MARK_BIT_USED((map)[(unit) / BITMAP_SIZE], (unit) % BITMAP_SIZE))
+
 #define GET_POOL_BY_INDEX(bindex) (pool.bpool + ((bindex)*MP_BLOCK))
-#define BLOCKS_TO_BYTES(nblocks)  ((nblocks)*MP_BLOCK);
+#define BLOCKS_TO_BYTES(nblocks)  ((nblocks)*MP_BLOCK)
 #define BITMAP_ELEMENTS(elements) (((elements) + (BITMAP_SIZE - 1)) / BITMAP_SIZE)
 
 #define IN_POOL(ptr)                 ((void *)ptr >= pool.bpool && (void *)ptr < (pool.bpool + (pool.npages * pagesize)))
@@ -63,48 +131,229 @@ typedef enum UOP {
   RECV = IORING_OP_RECV,
   SENDMSGZC = IORING_OP_SENDMSG_ZC,
   FRECV = 50,
-  TIMEOUT = 51,
+  DEADLINE = 51, // A link timeout, see ulink_deadline
+  CRECV = 52,
+  BRECV = 53,
+  BWRITE = 54,
+  SPLICEIN = 55,
+  SPLICEOUT = 56,
+  RECLAIM = 57,
+  LINKRECV = 58, // A receive linked to a send, see handle_link
+  CLOSE = 59,    // The last ops of a connection, see uclose
+  REBALANCE = 60,
+  HANDOFF = 61, // Cancels the receive of a connection handed to another worker, see handle_rebalance
+  ADOPT = 62,   // Receives the connections handed over by other workers
+  HANDSHAKE = 63, // Waits on the socket for the TLS handshake, see tls_handshake
+  ACCEPT_RETRY = 64, // Ends the accept backoff, see handle_accept
+  SWEEP = 65,        // Frees connections whose last completions were dropped, see handle_sweep
 } UOP;
 
-typedef struct Conntimeout {
-  uint8_t  op;
-  uint64_t last_used;
-  void    *conn;
-} Conntimeout;
-
+/*
+ * A receive linked to the final send of a response, see handle_link
+ */
+typedef enum LinkState {
+  LINK_NONE,
+  LINK_ARMED,
+  LINK_BROKEN, // The send failed and the receive was cancelled, waiting for the other completion
+} LinkState;
+
+typedef enum ChunkState {
+  CHUNK_SIZE_START,
+  CHUNK_SIZE,
+  CHUNK_EXT,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER,
+  CHUNK_TRAILER_LINE,
+  CHUNK_TRAILER_LF,
+  CHUNK_DONE,
+} ChunkState;
+
+typedef struct Ref {
+  Release fn;
+  void   *ctx;
+} Ref;
+
+/*
+ * Adaptive zero-copy threshold state, see adapt_send
+ */
+typedef struct SendTune {
+  uint32_t probe;
+  uint32_t samples[2]; // Since the threshold last moved, of copy and zero-copy
+} SendTune;
+
+/*
+ * Queueing delay admission state, see admit_req
+ */
+typedef struct Codel {
+  uint64_t idle;        // When the server last ran out of completions to handle
+  uint64_t above_until; // When the delay will have stayed above the target for an interval, 0 while below it
+  uint64_t drop_next;   // When the next request is rejected while dropping
+  uint32_t count;       // Requests rejected since dropping started
+  bool     dropping;
+} Codel;
+
+/*
+ * Arrays of the request being handled, sized on first use and released when run_handler returns
+ */
+typedef enum Scratch {
+  SCRATCH_HEADERS,
+  SCRATCH_PARAMS,
+  SCRATCH_RES_HEADERS,
+  NSCRATCH,
+} Scratch;
+
+/*
+ * A connection slot, the state touched by most completions, in two cache lines.
+ * What only some requests or rounds need is kept apart in its ConnCold, see COLD
+ */
 typedef struct Conn {
-  uint8_t op;
-
   int fd;
+
+  // Ops submitted for the connection with their last completion still to come, see utag
+  uint32_t inflight;
+  bool     closing; // Torn down by close_conn, the slot is released once inflight drops to 0
+  uint16_t handoff; // The worker it's being handed to plus one, see handle_rebalance
   struct {
     IOV iov[2];
-    IOV rec[2];
 
     uint64_t len;
+    uint32_t head_len; // The request line and headers at the start of rec[0]
+    uint16_t port;     // From the Host header
+    bool     close;    // Connection: close
+    bool     idle;     // Kept alive after a response, waiting for the next request
+    uint8_t  link;     // LinkState of a receive submitted with the last send
+  } recv;
+
+  struct {
+    IOV     *iov; // The scatter list, in the ConnCold
+    uint64_t len;
+    uint32_t iovlen;
+    uint32_t nrefs; // Buffers sent by reference, their release callbacks are in the ConnCold
+    uint16_t zc_notifs;
+  } send;
+
+  struct {
+    bool active; // A Streamer writes the content, its fn and ctx are in the ConnCold
+    bool done;   // The streamer wrote its last chunk
+    bool last;   // The last-chunk marker is queued
+    bool crlf;   // The previous chunk still needs its closing CRLF
+    bool close;  // Close the connection once the response is sent
+  } stream;
+
+  // HK_alloc chunks in use, the chunks themselves are in the ConnCold
+  uint8_t narena;
+} __attribute__((aligned(64))) Conn;
+
+/*
+ * The part of a connection slot that's left alone by requests without content, HK_alloc or handler arrays,
+ * and by the completions of a response after its first send
+ */
+typedef struct ConnCold {
+  struct {
+    IOV rec[2];
+
+    // When the head was received and the content received since, for config.body_min_rate
+    uint64_t body_start;
+    uint64_t body_bytes;
+
+    // When the receive of the next request was armed, its queueing delay is measured from it. See admit_req
+    uint64_t armed;
+
+    // Decoder state for Transfer-Encoding: chunked
+    struct {
+      uint8_t  state;
+      uint64_t size; // Bytes left in the current chunk
+    } chunk;
   } recv;
 
   struct {
-    IOV *iov;
     IOV *rec;
     MSG  msg;
 
-    uint16_t iovlen;
-    uint16_t reclen;
-    uint16_t zc_notifs;
-    uint64_t len;
+    // The scatter list starts here and moves to meta once it outgrows them
+    IOV siov[SEND_IOV];
+    IOV srec[SEND_IOV];
+    IOV meta;
+
+    // Release callbacks of the buffers sent by reference, run once the response is sent
+    IOV refs;
+
+    uint32_t reclen;
+    uint32_t cap;
+
+    // The path of the current round, picked on its first send so a round is never split between two
+    uint8_t  path;
+    bool     sampled; // Near the zero-copy threshold, so its cost is measured
+    uint64_t bytes;
+    uint64_t start;
+    uint64_t cpu;
   } send;
 
-  Conntimeout timeout;
-} Conn;
+  struct {
+    Streamer fn;
+    void    *ctx;
+  } stream;
+
+  size_t arena_used; // In the last HK_alloc chunk
+
+  // Request content streamed to the handler
+  struct {
+    BodyReader fn;
+    void      *ctx;
+
+    int fd;      // The destination of HK_splice_body
+    int pipe[2]; // Carries the content from the socket to fd
+
+    uint64_t left;  // Content bytes not asked for yet
+    uint64_t asked; // Bytes asked for by the op in flight
+    uint64_t piped; // Bytes waiting in the pipe
+    uint64_t start; // When the splice in flight was submitted
+    uint64_t cpu;   // CPU time spent submitting it
+
+    uint32_t head_len; // The response head formatted by the handler
+    uint8_t  win;      // The half of recv.rec[1] being received into
+    bool     active;
+    bool     chunked;
+    bool     splice;
+
+    Method method;
+    Status status;
+    bool   res_chunked;
+  } body;
+
+  IOV scratch[NSCRATCH];
+
+  // Memory of HK_alloc, released with the response
+  IOV arena[ARENA_CHUNKS];
+
+  // When the connection was accepted, the TLS handshake deadline is measured from it
+  uint64_t accepted;
+
+  // When the connection started closing, see handle_sweep
+  uint64_t closed;
+
+  // The TLS session of an HTTPS connection until its handshake is done and the kernel has the keys
+  struct ssl_st *tls;
+} ConnCold;
+
+/*
+ * Idle buffers of one class, advised MADV_FREE so the kernel can take their pages under pressure
+ */
+typedef struct MemClass {
+  void    *bufs[MEM_CLASS_DEPTH];
+  uint32_t n;
+} MemClass;
 
 typedef struct MPool {
   void *bpool;
 
   Conn *cpool;
 
-  IOV *iovpool;
-
-  IOV *recpool;
+  // Parallel to cpool, the rarely touched part of each slot and its generation, bumped when it's freed
+  ConnCold *ccold;
+  uint32_t *gens;
 
   uint32_t npages;
 
@@ -114,9 +363,67 @@ typedef struct MPool {
 
   uint64_t *freecs;
 
-  uint32_t timeout;
+  // Number of registered buffers the pool is split into, 0 when it's not registered
+  uint16_t nfixed;
+
+  // Send from the registered pool, cleared if the kernel doesn't support it
+  bool fixed_send;
+
+  // The pages the pool got, which can be smaller than the ones asked for in config.huge_pages
+  uint8_t huge_pages;
+  bool    locked;
+
+  // Recycled buffers mapped outside the pool, and their total size which is capped by config.mem_cache_size
+  MemClass cache[MEM_CLASSES];
+  size_t   cache_size;
+
+  // Free pool memory is given back to the system in units of reclaim_unit bytes, see MP_reclaim
+  bool      reclaimable;
+  size_t    reclaim_unit;
+  uint64_t *idle_units;
+  uint64_t *reclaimed_units;
+
+  // Live connections and used blocks, for admission control
+  uint32_t nconns;
+  size_t   used_blocks;
+
+  // The multishot accept, which is cancelled while accepting is paused or backing off
+  int  listenfd;
+  bool accept_armed;
+  bool accept_paused;
+  bool accept_backoff;
+
+  // Slots are swept once the kernel has dropped completions, see handle_sweep
+  bool sweeping;
 } MPool;
 
+/*
+ * The load a multi_core worker publishes to the others, each in its own cache line
+ */
+typedef struct WorkerLoad {
+  uint32_t conns;
+  bool     gone; // Its receiving end was closed, the worker exited. See send_conn
+} __attribute__((aligned(64))) WorkerLoad;
+
+/*
+ * Connection handoff between multi_core workers, see handle_rebalance
+ */
+typedef struct Balance {
+  WorkerLoad *loads; // Shared by the workers, NULL when they don't rebalance
+  int        *socks; // Two per worker, the end it receives handed off connections on and the end to send them on
+  int         nworkers;
+  int         self;
+
+  // The receive of the next connection handed over
+  MSG  msg;
+  IOV  iov;
+  char byte;
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } control;
+} Balance;
+
 extern struct io_uring ring;
 
 extern ServConfig config;
@@ -125,6 +432,11 @@ extern int pipe_sz;
 extern int pipe_in, pipe_out, nullfd;
 
 extern MPool    pool;
+extern ServStats stats;
+extern SendTune tune;
+extern Codel    codel;
+extern Balance  balance;
+extern struct ssl_ctx_st *tls_ctx;
 extern Conn    *current_conn;
 extern Request *current_req;
 extern size_t   pagesize;
@@ -4,8 +4,120 @@
 
 #include "pool.h"
 #include "types.h"
+#include <limits.h>
 #include <sys/poll.h>
 
+/*
+ * Return the time of clock in nanoseconds
+ */
+static inline uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Submit the prepared ops, adding the CPU time it took to cpu if it's set.
+ * Ops that can complete right away, like copying into the socket, are done during the submit
+ */
+static inline int usubmit(uint64_t *cpu) {
+  if (!cpu)
+    return io_uring_submit(&ring);
+
+  uint64_t start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  int      res = io_uring_submit(&ring);
+  *cpu += clock_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+  return res;
+}
+
+/*
+ * Create the ring with the best setup the kernel supports, falling back one step at a time on older kernels.
+ * Return the name of the setup on success, NULL on failure
+ */
+static inline const char *uinit_ring(uint32_t entries) {
+  static const struct {
+    unsigned    flags;
+    const char *mode;
+  } setups[] = {
+      // Completions are only processed when the worker asks for them, never interrupting a handler
+      {IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP, "defer_taskrun"},
+      // Completions wait for the next transition into the kernel instead of interrupting the worker
+      {IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG | IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP, "coop_taskrun"},
+      {IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP, "cqsize"},
+      {0, "default"},
+  };
+
+  uint64_t cq_entries = (uint64_t)config.max_concurrent_clients * CQES_PER_CONN;
+  if (cq_entries < (uint64_t)entries * 2)
+    cq_entries = (uint64_t)entries * 2;
+  if (cq_entries > UINT32_MAX)
+    cq_entries = UINT32_MAX;
+
+  for (size_t i = 0; i < sizeof(setups) / sizeof(setups[0]); i++) {
+    struct io_uring_params params = {0};
+    params.flags = setups[i].flags;
+    params.cq_entries = cq_entries;
+    if (io_uring_queue_init_params(entries, &ring, &params) < 0)
+      continue;
+
+    stats.ring_mode = setups[i].mode;
+    stats.ring_sq_entries = params.sq_entries;
+    stats.ring_cq_entries = params.cq_entries;
+    // Saves the fd lookup on every io_uring_enter, not fatal when unsupported
+    stats.ring_fd_registered = (io_uring_register_ring_fd(&ring) == 1);
+    if (config.busy_poll_us) {
+      struct io_uring_napi napi = {0};
+      napi.busy_poll_to = config.busy_poll_us;
+      napi.prefer_busy_poll = config.prefer_busy_poll;
+      stats.napi_registered = (io_uring_register_napi(&ring, &napi) == 0);
+    }
+    return setups[i].mode;
+  }
+
+  return NULL;
+}
+
+/*
+ * Return the index of the registered buffer holding len bytes at base, -1 if there is none
+ */
+static inline int fixed_index(const void *base, size_t len) {
+  if (!pool.nfixed || !len || !IN_POOL(base) || !IN_POOL((char *)base + len - 1))
+    return -1;
+
+  size_t start = (char *)base - (char *)pool.bpool;
+  size_t index = start / FIXED_BUF_MAX;
+  if (index != (start + len - 1) / FIXED_BUF_MAX)
+    return -1;
+
+  return index;
+}
+
+/*
+ * Similar to fixed_index but all the iovs have to be in the same registered buffer
+ */
+static inline int fixed_iovs(const IOV *iov, size_t iovlen) {
+  int index = -1;
+  for (size_t i = 0; i < iovlen; i++) {
+    if (!iov[i].iov_len)
+      continue;
+
+    int cur = fixed_index(iov[i].iov_base, iov[i].iov_len);
+    if (cur < 0 || (index >= 0 && cur != index))
+      return -1;
+    index = cur;
+  }
+
+  return index;
+}
+
+/*
+ * Tag sqe as op of conn, and count it until its last completion is in, see handle_cqe
+ */
+static inline void utag(struct io_uring_sqe *sqe, Conn *conn, UOP op) {
+  sqe->user_data = CONN_UD(conn, op);
+  conn->inflight++;
+}
+
 /*
  * Prepare and submit a multi-shot accept uring op
  */
@@ -17,23 +129,186 @@ static inline int umaccept(int listenfd) {
   if (!sqe)
     return -1;
 
-  sqe->user_data = ACCEPT;
-  io_uring_prep_multishot_accept(sqe, listenfd, NULL, NULL, SOCK_NONBLOCK);
-  return io_uring_submit(&ring);
+  // Accepted sockets block, so reads of the registered buffers wait for data in the ring instead of failing with
+  // EAGAIN. The TLS handshake runs on a non-blocking one, see tls_handshake
+  io_uring_prep_multishot_accept(sqe, listenfd, NULL, NULL, (tls_ctx) ? SOCK_NONBLOCK : 0);
+  sqe->user_data = UD(ACCEPT, 0, 0);
+  int res = io_uring_submit(&ring);
+  if (res < 0)
+    return -1;
+
+  pool.accept_armed = true;
+  return res;
+}
+
+/*
+ * Prepare and submit the timeout that runs the next pool reclaim, or the next op timer
+ */
+static inline int utimer(UOP op, uint32_t ms) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe)
+    return -1;
+
+  struct __kernel_timespec ts = {0};
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  io_uring_prep_timeout(sqe, &ts, 0, 0);
+  sqe->user_data = UD(op, 0, 0);
+  int res = io_uring_submit(&ring);
+  if (res < 0)
+    return -1;
+
+  return res;
 }
 
-static inline int urecv(Conn *conn, IOV *iov) {
-  if (!conn || !iov || !iov->iov_base || !iov->iov_len)
+/*
+ * Prepare and submit the receive of the next connection handed over by another worker
+ */
+static inline int uadopt(void) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe)
     return -1;
 
+  balance.iov.iov_base = &balance.byte;
+  balance.iov.iov_len = 1;
+  memset(&balance.msg, 0, sizeof(MSG));
+  balance.msg.msg_iov = &balance.iov;
+  balance.msg.msg_iovlen = 1;
+  balance.msg.msg_control = balance.control.buf;
+  balance.msg.msg_controllen = sizeof(balance.control.buf);
+  io_uring_prep_recvmsg(sqe, balance.socks[balance.self * 2], &balance.msg, 0);
+  sqe->user_data = UD(ADOPT, 0, 0);
+  int res = io_uring_submit(&ring);
+  if (res < 0)
+    return -1;
+
+  return res;
+}
+
+/*
+ * Cancel the multi-shot accept, its final completion clears pool.accept_armed
+ */
+static inline int ucancel_accept(void) {
   struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
   if (!sqe)
     return -1;
 
-  conn->op = RECV;
-  sqe->user_data = (__u64)conn;
-  sqe->rw_flags = IORING_RECVSEND_POLL_FIRST;
-  io_uring_prep_recv(sqe, conn->fd, iov->iov_base, iov->iov_len, MSG_NOSIGNAL);
+  io_uring_prep_cancel64(sqe, UD(ACCEPT, 0, 0), 0);
+  sqe->user_data = 0;
+  int res = io_uring_submit(&ring);
+  if (res < 0)
+    return -1;
+
+  return res;
+}
+
+/*
+ * How long in nanoseconds an op of conn may take before it's cancelled and the connection dropped, 0 for no limit
+ */
+static inline uint64_t op_deadline(Conn *conn, UOP op) {
+  ConnCold *cold = COLD(conn);
+  switch (op) {
+  case FRECV:
+    // The head arrives with the first receive, a new connection has header_timeout_ms to send it
+    return (conn->recv.idle ? config.idle_timeout_ms : config.header_timeout_ms) * 1000000ULL;
+  case LINKRECV:
+    return config.idle_timeout_ms * 1000000ULL;
+  case RECV:
+  case CRECV:
+  case BRECV:
+  case SPLICEIN:
+    if (!config.body_min_rate)
+      return 0;
+
+    // Each byte of content received moves the deadline by 1/body_min_rate, after header_timeout_ms of grace
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    uint64_t due = cold->recv.body_start + config.header_timeout_ms * 1000000ULL
+                   + cold->recv.body_bytes * 1000000000ULL / config.body_min_rate;
+    return (due > now) ? due - now : 1;
+  case SENDMSG:
+  case SENDMSGZC:
+    return config.send_timeout_ms * 1000000ULL;
+  case HANDSHAKE: {
+    if (!config.header_timeout_ms)
+      return 0;
+
+    // The TLS handshake comes out of the header_timeout_ms of a new connection
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    uint64_t due = cold->accepted + config.header_timeout_ms * 1000000ULL;
+    return (due > now) ? due - now : 1;
+  }
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Link a deadline of ns to the op in sqe, the sqe taken right before it.
+ * ts is read when the ops are submitted so it has to last until then.
+ * Return the deadline sqe, NULL when there is no deadline
+ */
+static inline struct io_uring_sqe *ulink_deadline(struct io_uring_sqe *sqe, Conn *conn, struct __kernel_timespec *ts,
+                                                  uint64_t ns) {
+  if (!ns)
+    return NULL;
+
+  struct io_uring_sqe *timeout = io_uring_get_sqe(&ring);
+  if (!timeout)
+    return NULL;
+
+  ts->tv_sec = ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+  sqe->flags |= IOSQE_IO_LINK;
+  io_uring_prep_link_timeout(timeout, ts, 0);
+  utag(timeout, conn, DEADLINE);
+  return timeout;
+}
+
+static inline void uprep_recv(struct io_uring_sqe *sqe, Conn *conn, IOV *iov, UOP op) {
+  int fixed = fixed_index(iov->iov_base, iov->iov_len);
+  if (fixed >= 0)
+    io_uring_prep_read_fixed(sqe, conn->fd, iov->iov_base, iov->iov_len, 0, fixed);
+  else
+    io_uring_prep_recv(sqe, conn->fd, iov->iov_base, iov->iov_len, MSG_NOSIGNAL);
+  utag(sqe, conn, op);
+}
+
+/*
+ * Prepare and submit a recv into the iov, its completion is handled as op
+ */
+static inline int urecv(Conn *conn, IOV *iov, UOP op) {
+  if (!conn || conn->closing || !iov || !iov->iov_base || !iov->iov_len)
+    return -1;
+
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe)
+    return -1;
+
+  struct __kernel_timespec ts;
+  uprep_recv(sqe, conn, iov, op);
+  ulink_deadline(sqe, conn, &ts, op_deadline(conn, op));
+  int res = io_uring_submit(&ring);
+  if (res < 0)
+    return -1;
+
+  return res;
+}
+
+/*
+ * Prepare and submit a poll of the socket of conn for events, its completion is handled as op
+ */
+static inline int upoll(Conn *conn, uint32_t events, UOP op) {
+  if (!conn || conn->closing)
+    return -1;
+
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe)
+    return -1;
+
+  struct __kernel_timespec ts;
+  io_uring_prep_poll_add(sqe, conn->fd, events);
+  utag(sqe, conn, op);
+  ulink_deadline(sqe, conn, &ts, op_deadline(conn, op));
   int res = io_uring_submit(&ring);
   if (res < 0)
     return -1;
@@ -48,61 +323,111 @@ static inline int ufrecv(Conn *conn) {
   IOV *iov, *rec;
 
   iov = &conn->recv.iov[0];
-  rec = &conn->recv.rec[0];
+  rec = &COLD(conn)->recv.rec[0];
   memcpy(iov, rec, sizeof(IOV));
-  memset(rec->iov_base, 0, rec->iov_len);
-  int res = urecv(conn, iov);
-  if (res < 0)
-    return -1;
-
-  conn->op = FRECV;
-  return res;
+  COLD(conn)->recv.armed = clock_ns(CLOCK_MONOTONIC);
+  return urecv(conn, iov, FRECV);
 }
 
 /*
  * Prepare and submit a sendmsg uring op
  */
 static inline int usendmsg(Conn *conn, size_t iov_index, size_t nios) {
-  if (!conn || conn->fd <= 0)
+  if (!conn || conn->fd <= 0 || conn->closing)
     return -1;
 
+  ConnCold *cold = COLD(conn);
+
   struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
   if (!sqe)
     return -1;
 
-  bool zc = (conn->send.len > ZC_RES) ? true : false;
-  conn->op = (zc) ? SENDMSGZC : SENDMSG;
+  struct msghdr *msg = &cold->send.msg;
+  msg->msg_iov = &conn->send.iov[iov_index];
+  msg->msg_iovlen = (nios > IOV_MAX) ? IOV_MAX : nios;
+
+  // Responses held entirely in the registered pool are sent zero-copy from their fixed buffer
+  int fixed = (pool.fixed_send) ? fixed_iovs(msg->msg_iov, msg->msg_iovlen) : -1;
+  if (!cold->send.path) {
+    uint64_t threshold = (fixed >= 0) ? (stats.zc_threshold / ZC_FIXED_DIV) : stats.zc_threshold;
+    uint64_t len = conn->send.len;
+    // kTLS sockets refuse MSG_ZEROCOPY, the kernel copies the records it encrypts anyway
+    bool zc = (len > threshold && !tls_ctx) ? true : false;
+
+    // Sample the rounds near the threshold, sending some on the other path to measure both
+    cold->send.sampled = (!tls_ctx && len > threshold / 2 && len <= threshold * 2);
+    if (cold->send.sampled) {
+      if (++tune.probe % SEND_PROBE_RATE == 0)
+        zc = !zc;
+      cold->send.start = clock_ns(CLOCK_MONOTONIC);
+    }
 
-  sqe->user_data = (__u64)conn;
+    cold->send.path = (zc) ? SENDMSGZC : SENDMSG;
+    cold->send.bytes = len;
+  }
+
+  bool zc = (cold->send.path == SENDMSGZC);
+
+  // The final round of a small response takes the receive of the next request along, with both their deadlines
+  bool link = (!zc && !cold->send.sampled && msg->msg_iovlen == nios && conn->send.len <= LINK_MAX_RES
+               && !conn->send.nrefs && !conn->narena && (!conn->stream.active || conn->stream.last)
+               && !conn->recv.close && conn->recv.link == LINK_NONE && !cold->body.active && io_uring_sq_space_left(&ring) >= 3);
+
+  struct __kernel_timespec send_ts, recv_ts;
   sqe->rw_flags = IORING_RECVSEND_POLL_FIRST;
-  struct msghdr *msg = &conn->send.msg;
-  msg->msg_iov = &conn->send.iov[iov_index];
-  msg->msg_iovlen = nios;
-  if (zc) {
+  if (link) {
+    // Fully sent or failed, so the receive never starts before the response is out.
+    // It only completes when it fails, so it isn't counted in inflight
+    io_uring_prep_sendmsg(sqe, conn->fd, msg, MSG_NOSIGNAL | MSG_WAITALL);
+    sqe->user_data = CONN_UD(conn, cold->send.path);
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    struct io_uring_sqe *deadline = ulink_deadline(sqe, conn, &send_ts, op_deadline(conn, SENDMSG));
+    if (deadline)
+      deadline->flags |= IOSQE_IO_LINK;
+    else
+      sqe->flags |= IOSQE_IO_LINK;
+
+    struct io_uring_sqe *next = io_uring_get_sqe(&ring);
+    conn->recv.iov[0] = cold->recv.rec[0];
+    cold->recv.armed = clock_ns(CLOCK_MONOTONIC);
+    uprep_recv(next, conn, &conn->recv.iov[0], LINKRECV);
+    ulink_deadline(next, conn, &recv_ts, op_deadline(conn, LINKRECV));
+    conn->recv.link = LINK_ARMED;
+    stats.linked_sends++;
+  } else if (zc) {
     io_uring_prep_sendmsg_zc(sqe, conn->fd, msg, MSG_NOSIGNAL);
+    utag(sqe, conn, cold->send.path);
+    if (fixed >= 0) {
+      sqe->ioprio |= IORING_RECVSEND_FIXED_BUF;
+      sqe->buf_index = fixed;
+    }
     conn->send.zc_notifs++;
   } else {
     io_uring_prep_sendmsg(sqe, conn->fd, msg, MSG_NOSIGNAL);
+    utag(sqe, conn, cold->send.path);
   }
-  int res = io_uring_submit(&ring);
+  if (!link)
+    ulink_deadline(sqe, conn, &send_ts, op_deadline(conn, cold->send.path));
+  int res = usubmit((cold->send.sampled) ? &cold->send.cpu : NULL);
   if (res < 0)
     return -1;
 
   return res;
 }
 
-static inline int utimeout(Conn *conn) {
-  if (!conn || conn->fd <= 0)
+/*
+ * Prepare and submit a write of the iov into fd at the current file position
+ */
+static inline int uwrite(Conn *conn, int fd, IOV *iov) {
+  if (!conn || conn->closing || fd < 0 || !iov || !iov->iov_base || !iov->iov_len)
     return -1;
 
   struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
   if (!sqe)
     return -1;
 
-  struct __kernel_timespec ts = {0};
-  ts.tv_sec = 1;
-  sqe->user_data = (__u64)&conn->timeout;
-  io_uring_prep_timeout(sqe, &ts, 0, 0);
+  io_uring_prep_write(sqe, fd, iov->iov_base, iov->iov_len, -1);
+  utag(sqe, conn, BWRITE);
   int res = io_uring_submit(&ring);
   if (res < 0)
     return -1;
@@ -110,20 +435,120 @@ static inline int utimeout(Conn *conn) {
   return res;
 }
 
-static inline int ucancel(Conn *conn) {
-  if (!conn || conn->fd <= 0)
+/*
+ * Prepare and submit a splice of up to len bytes from fd_in to fd_out
+ */
+static inline int usplice(Conn *conn, int fd_in, int fd_out, size_t len, UOP op) {
+  if (!conn || conn->closing || fd_in < 0 || fd_out < 0 || !len)
     return -1;
 
   struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
   if (!sqe)
     return -1;
-  io_uring_prep_cancel(sqe, conn, 0);
 
-  int res = io_uring_submit(&ring);
+  ConnCold                *cold = COLD(conn);
+  struct __kernel_timespec ts;
+  io_uring_prep_splice(sqe, fd_in, -1, fd_out, -1, len, SPLICE_F_MOVE);
+  utag(sqe, conn, op);
+  ulink_deadline(sqe, conn, &ts, op_deadline(conn, op));
+  cold->body.start = clock_ns(CLOCK_MONOTONIC);
+  cold->body.cpu = 0;
+  int res = usubmit(&cold->body.cpu);
   if (res < 0)
     return -1;
 
   return res;
 }
 
+/*
+ * Prepare the cancellation of every op of conn, whatever it was tagged with
+ */
+static inline struct io_uring_sqe *ucancel(Conn *conn) {
+  if (!conn || conn->fd <= 0)
+    return NULL;
+
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe)
+    return NULL;
+
+  io_uring_prep_cancel_fd(sqe, conn->fd, IORING_ASYNC_CANCEL_ALL);
+  sqe->user_data = 0;
+  return sqe;
+}
+
+/*
+ * Prepare the cancellation of the receive conn waits for its next request on, to hand it off.
+ * Fails when the receive already completed, or is linked to a send that hasn't
+ */
+static inline int ucancel_recv(Conn *conn) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe)
+    return -1;
+
+  io_uring_prep_cancel64(sqe, CONN_UD(conn, (conn->recv.link == LINK_ARMED) ? LINKRECV : FRECV), 0);
+  utag(sqe, conn, HANDOFF);
+  return 0;
+}
+
+/*
+ * Prepare the send of a static response conn is closed after. It's hard linked ahead of the ops uclose prepares,
+ * so the close waits for it to be sent, to fail or to run past send_timeout_ms, and it's only submitted with them.
+ * Return -1 when there is no room for the send and the close together
+ */
+static inline int usend_last(Conn *conn, const char *str, size_t len) {
+  // Read at submission, it's the same deadline for every connection
+  static struct __kernel_timespec ts;
+
+  if (!conn || conn->closing || io_uring_sq_space_left(&ring) < 7)
+    return -1;
+
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  io_uring_prep_send(sqe, conn->fd, str, len, MSG_NOSIGNAL);
+  sqe->user_data = 0;
+  sqe->flags |= IOSQE_IO_HARDLINK;
+
+  struct io_uring_sqe *deadline = ulink_deadline(sqe, conn, &ts, op_deadline(conn, SENDMSG));
+  if (deadline)
+    deadline->flags |= IOSQE_IO_HARDLINK;
+  return 0;
+}
+
+/*
+ * Tear conn down through the ring: cancel its ops, shut the socket down so splices reading from it
+ * return, and close it, hard linked so each runs whatever the one before returned.
+ * A socket handed to another worker is only closed. Its body pipes are closed along.
+ * Return -1 when there is no room in the submission queue
+ */
+static inline int uclose(Conn *conn) {
+  ConnCold *cold = COLD(conn);
+  if (io_uring_sq_space_left(&ring) < 5)
+    return -1;
+
+  struct io_uring_sqe *sqe = ucancel(conn);
+  if (!sqe)
+    return -1;
+  sqe->flags |= IOSQE_IO_HARDLINK;
+
+  if (!conn->handoff) {
+    sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_shutdown(sqe, conn->fd, SHUT_RDWR);
+    sqe->flags |= IOSQE_IO_HARDLINK;
+    sqe->user_data = 0;
+  }
+
+  sqe = io_uring_get_sqe(&ring);
+  io_uring_prep_close(sqe, conn->fd);
+  utag(sqe, conn, CLOSE);
+
+  for (int i = 0; i < 2 && cold->body.pipe[0] > 0; i++) {
+    sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_close(sqe, cold->body.pipe[i]);
+    utag(sqe, conn, CLOSE);
+  }
+
+  // Left in the queue on failure, they go with the next submission
+  io_uring_submit(&ring);
+  return 0;
+}
+
 #endif
\ No newline at end of file
@@ -39,6 +39,13 @@ static inline int tcp_listen(uint16_t port) {
   if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
     return -1;
 
+  // Accepted sockets inherit these. Not fatal, raising SO_BUSY_POLL may not be permitted
+  if (config.busy_poll_us) {
+    int usecs = config.busy_poll_us, prefer = config.prefer_busy_poll;
+    setsockopt(listenfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+    setsockopt(listenfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+  }
+
   if (bind(listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
     return -1;
 
@@ -68,96 +75,236 @@ static inline size_t get_nroutes(Route *routes) {
 }
 
 /*
- * Read the value of the Content-Length header
- * return -1 if the header does not exist
+ * Compare the len bytes at src with the string lit, ignoring case
  */
-static inline long get_content_length(char *src, char *end) {
-  char *line = src;
-  char *key, *colon, *value;
-  if (memcmp(line, "\r\n", 2) == 0)
-    line += 2;
-  while (line && line < end) {
-    if (memcmp(line, "\r\n", 2) == 0)
-      break;
+static inline bool slice_equ(const char *src, size_t len, const char *lit) {
+  return strlen(lit) == len && strncasecmp(src, lit, len) == 0;
+}
 
-    char *line_end = memchr(line, '\r', end - line);
-    if (!line_end)
-      return -1;
-    key = line;
+#define KNOWN(name) {name, STRLEN(name)}
+
+static const struct {
+  const char *name;
+  size_t      len;
+} known_headers[NKNOWN_HEADERS] = {
+    [HEADER_HOST] = KNOWN("host"),
+    [HEADER_CONNECTION] = KNOWN("connection"),
+    [HEADER_CONTENT_LENGTH] = KNOWN("content-length"),
+    [HEADER_CONTENT_TYPE] = KNOWN("content-type"),
+    [HEADER_TRANSFER_ENCODING] = KNOWN("transfer-encoding"),
+    [HEADER_EXPECT] = KNOWN("expect"),
+    [HEADER_ACCEPT] = KNOWN("accept"),
+    [HEADER_ACCEPT_ENCODING] = KNOWN("accept-encoding"),
+    [HEADER_COOKIE] = KNOWN("cookie"),
+    [HEADER_AUTHORIZATION] = KNOWN("authorization"),
+    [HEADER_IF_NONE_MATCH] = KNOWN("if-none-match"),
+    [HEADER_IF_MODIFIED_SINCE] = KNOWN("if-modified-since"),
+    [HEADER_USER_AGENT] = KNOWN("user-agent"),
+    [HEADER_RANGE] = KNOWN("range"),
+    [HEADER_ORIGIN] = KNOWN("origin"),
+    [HEADER_REFERER] = KNOWN("referer"),
+};
 
-    colon = memchr(key, ':', line_end - key);
-    if (!colon)
-      return -1;
+/*
+ * Return the KnownHeader of the header key of len bytes, -1 if it's not one
+ */
+static inline int classify_header(const char *key, size_t len) {
+  if (!len)
+    return -1;
 
-    *colon = '\0';
-    if (strcasecmp(key, "Content-Length") != 0) {
-      line = line_end + 2;
-      *colon = ':';
-      continue;
-    }
-    *colon = ':';
+  char first = key[0] | 0x20; // Lower case
+  for (int i = 0; i < NKNOWN_HEADERS; i++)
+    if (known_headers[i].len == len && known_headers[i].name[0] == first
+        && strncasecmp(known_headers[i].name, key, len) == 0)
+      return i;
 
-    value = (colon + 1);
-    while (*value == ' ')
-      value++;
+  return -1;
+}
 
-    *line_end = '\0';
-    long res = atol(value);
-    *line_end = '\r';
+/*
+ * Read the decimal number in the len bytes at src
+ * return -1 if they are not one
+ */
+static inline long slice_to_long(const char *src, size_t len) {
+  if (len == 0 || len > 18)
+    return -1;
 
-    return res;
+  long res = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (src[i] < '0' || src[i] > '9')
+      return -1;
+    res = (res * 10) + (src[i] - '0');
   }
-  return -1;
+
+  return res;
 }
 
 /*
- * Check wether the request has a header
+ * Split the header line at *pos into header and move *pos to the next line.
+ * Return 1 if a header was read, 0 at the empty line ending the headers, -1 if the line is malformed
  */
-static inline bool have_header(char *src, char *end, const char *header_key, const char *header_value) {
-  char *line = src;
-  char *key, *colon, *value;
-  if (memcmp(line, "\r\n", 2) == 0)
-    line += 2;
-  while (line && line < end) {
-    if (memcmp(line, "\r\n", 2) == 0)
-      break;
+static inline int next_header(char **pos, char *end, Header *header) {
+  char *line = *pos;
+  if (line >= end)
+    return 0;
+
+  char *line_end = memchr(line, '\r', end - line);
+  if (!line_end || line_end + 1 >= end || line_end[1] != '\n')
+    return -1;
+  if (line_end == line)
+    return 0;
+  *pos = line_end + 2;
 
-    key = line;
-    while (*key == ' ')
-      key++;
-    while (*header_key == ' ')
-      header_key++;
+  while (line < line_end && (*line == ' ' || *line == '\t'))
+    line++;
 
-    char *line_end = memchr(line, '\r', end - line);
-    if (!line_end)
-      return false;
+  char *colon = memchr(line, ':', line_end - line);
+  if (!colon || colon == line)
+    return -1;
 
-    colon = memchr(key, ':', line_end - key);
-    if (!colon)
-      return -1;
+  char *value = colon + 1;
+  while (value < line_end && (*value == ' ' || *value == '\t'))
+    value++;
+  while (line_end > value && (line_end[-1] == ' ' || line_end[-1] == '\t'))
+    line_end--;
+
+  header->key = line;
+  header->key_len = colon - line;
+  header->value = value;
+  header->value_len = line_end - value;
+  return 1;
+}
 
-    *colon = '\0';
-    if (strcasecmp(key, header_key) != 0) {
-      line = line_end + 2;
-      *colon = ':';
+/*
+ * Collect the known headers from the header lines between start and end in a single pass.
+ * Headers the request doesn't have are left with a NULL key.
+ * A repeated Content-Length or Transfer-Encoding fails, another server could frame the content by the other one
+ */
+static inline int scan_headers(char *start, char *end, Header known[NKNOWN_HEADERS]) {
+  Header header;
+  int    res;
+  while ((res = next_header(&start, end, &header)) > 0) {
+    int index = classify_header(header.key, header.key_len);
+    if (index < 0)
       continue;
-    }
-    *colon = ':';
 
-    value = (colon + 1);
-    while (*value == ' ')
-      value++;
-    while (*header_value == ' ')
-      header_value++;
+    if (!known[index].key)
+      known[index] = header;
+    else if (index == HEADER_CONTENT_LENGTH || index == HEADER_TRANSFER_ENCODING)
+      return -1;
+  }
+
+  return res;
+}
+
+/*
+ * Read the value of the Content-Length header
+ * return -1 if the header does not exist, -2 if its value is not a number
+ */
+static inline long get_content_length(Header *header) {
+  if (!header->key)
+    return -1;
+
+  long res = slice_to_long(header->value, header->value_len);
+  return (res < 0) ? -2 : res;
+}
 
-    *line_end = '\0';
-    bool res = (strcasecmp(value, header_value) == 0);
-    *line_end = '\r';
+/*
+ * Return the value of a hex digit or -1 if c is not one
+ */
+static inline int hex_val(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
 
-    return res;
+/*
+ * Decode len bytes of chunked content from src into dst, dropping the framing.
+ * dst may be the same as src since the content never grows while decoding.
+ * The state is kept in conn, so the framing can be split across recvs.
+ * Return the decoded size on success, -1 on malformed framing.
+ */
+static inline long decode_chunks(Conn *conn, char *dst, char *src, size_t len) {
+  uint8_t  *state = &COLD(conn)->recv.chunk.state;
+  uint64_t *size = &COLD(conn)->recv.chunk.size;
+  char     *end = src + len;
+  size_t    total = 0;
+  int       digit;
+
+  while (src < end && *state != CHUNK_DONE) {
+    switch (*state) {
+    case CHUNK_SIZE_START:
+    case CHUNK_SIZE:
+      digit = hex_val(*src);
+      if (digit >= 0) {
+        if (*size > (UINT64_MAX >> 4))
+          return -1;
+        *size = (*size << 4) | digit;
+        *state = CHUNK_SIZE;
+      } else if (*state == CHUNK_SIZE_START) {
+        return -1;
+      } else if (*src == '\n') {
+        *state = (*size > 0) ? CHUNK_DATA : CHUNK_TRAILER;
+      } else {
+        *state = CHUNK_EXT;
+      }
+      src++;
+      break;
+    case CHUNK_EXT:
+      if (*src++ == '\n')
+        *state = (*size > 0) ? CHUNK_DATA : CHUNK_TRAILER;
+      break;
+    case CHUNK_DATA: {
+      size_t n = end - src;
+      if (n > *size)
+        n = *size;
+      if (dst + total != src)
+        memmove(dst + total, src, n);
+      total += n, src += n, *size -= n;
+      if (*size == 0)
+        *state = CHUNK_DATA_CR;
+      break;
+    }
+    case CHUNK_DATA_CR:
+      if (*src == '\r')
+        *state = CHUNK_DATA_LF;
+      else if (*src == '\n')
+        *state = CHUNK_SIZE_START;
+      else
+        return -1;
+      src++;
+      break;
+    case CHUNK_DATA_LF:
+      if (*src++ != '\n')
+        return -1;
+      *state = CHUNK_SIZE_START;
+      break;
+    case CHUNK_TRAILER:
+      if (*src == '\r')
+        *state = CHUNK_TRAILER_LF;
+      else if (*src == '\n')
+        *state = CHUNK_DONE;
+      else
+        *state = CHUNK_TRAILER_LINE;
+      src++;
+      break;
+    case CHUNK_TRAILER_LINE:
+      if (*src++ == '\n')
+        *state = CHUNK_TRAILER;
+      break;
+    case CHUNK_TRAILER_LF:
+      if (*src++ != '\n')
+        return -1;
+      *state = CHUNK_DONE;
+      break;
+    }
   }
 
-  return false;
+  return total;
 }
 
 /*
@@ -490,11 +637,15 @@ static inline size_t status_len(Status status) {
 /*
  * Return true if routes match
  */
+static inline bool path_equ(const char *path, Request *req) {
+  return strlen(path) == req->path_len && memcmp(path, req->path, req->path_len) == 0;
+}
+
 static inline bool route_equ(Route *route, Request *req) {
   return (route->method == CATCHALL // The special method
           || route->method == req->method)
          && (strcmp(route->path, "**") == 0 // The special path
-             || strcmp(route->path, req->path) == 0);
+             || path_equ(route->path, req));
 }
 
 /*
@@ -507,7 +658,7 @@ static inline int match_route(Server *serv, Request *req) {
       continue;
     if (route_equ(&route, req))
       return i;
-    else if (req->method == HEAD && route.method == GET && strcmp(route.path, req->path) == 0)
+    else if (req->method == HEAD && route.method == GET && path_equ(route.path, req))
       return i;
   }
   return -1;
@@ -524,36 +675,63 @@ static inline bool should_have_content_length(Request *req, ResWriter *res) {
 }
 
 /*
- * Format http response from the ResWriter.
- * Return response size on success, 0 on failure.
+ * Format the status line and the headers from the ResWriter.
+ * Return the formatted size on success, buffer_size + 1 if the buffer is too small, 0 on failure.
  */
-static inline size_t fmt_res(Request *req, ResWriter *res, char *buffer, size_t buffer_size) {
+static inline size_t fmt_res_head(ResWriter *res, char *buffer, size_t buffer_size) {
   if (!res || !buffer || buffer_size == 0)
     return 0;
 
   if (!res->status)
     res->status = STATUSOK;
 
-  size_t   res_len, total = 0;
-  char    *dst = buffer;
-  size_t   maxlen = buffer_size;
-  bool     have_content_length = should_have_content_length(req, res);
-  uint64_t body_length = res->len;
+  int    res_len;
+  size_t total = 0;
+  char  *dst = buffer;
+  size_t maxlen = buffer_size;
 
   res_len = snprintf(dst, maxlen, "HTTP/1.1 %d %s", (int)res->status, status_str(res->status));
+  if (res_len < 0)
+    return 0;
+  if ((size_t)res_len >= maxlen)
+    return buffer_size + 1;
   total += res_len;
   dst += res_len;
   maxlen -= res_len;
 
   for (size_t i = 0; i < res->nheaders; i++) {
     Header *header = &res->headers[i];
-    res_len = snprintf(dst, maxlen, "\r\n%s: %s", header->key, header->value);
+    res_len = snprintf(dst, maxlen, "\r\n%.*s: %.*s", (int)header->key_len, header->key, (int)header->value_len, header->value);
+    if (res_len < 0)
+      return 0;
+    if ((size_t)res_len >= maxlen)
+      return buffer_size + 1;
     total += res_len;
     dst += res_len;
     maxlen -= res_len;
   }
 
-  if (have_content_length) {
+  return total;
+}
+
+/*
+ * Format the content length, or the transfer encoding, and the end of the response head.
+ * Return the formatted size on success, 0 on failure.
+ */
+static inline size_t fmt_res_end(Request *req, ResWriter *res, char *buffer, size_t buffer_size) {
+  if (!res || !buffer || buffer_size < 4)
+    return 0;
+
+  size_t   res_len, total = 0;
+  char    *dst = buffer;
+  size_t   maxlen = buffer_size;
+  bool     have_content_length = should_have_content_length(req, res);
+  uint64_t body_length = res->len;
+
+  if (have_content_length && res->chunked) {
+    res_len = snprintf(dst, maxlen, "\r\nTransfer-Encoding: chunked");
+    total += res_len, dst += res_len, maxlen -= res_len;
+  } else if (have_content_length) {
     res_len = snprintf(dst, maxlen, "\r\nContent-Length: %lu", body_length);
     total += res_len, dst += res_len, maxlen -= res_len;
   }
@@ -564,126 +742,149 @@ static inline size_t fmt_res(Request *req, ResWriter *res, char *buffer, size_t
   return total;
 }
 
+/*
+ * Format the size line that goes before a chunk of len bytes.
+ * The CRLF closing the previous chunk is written first if crlf is true,
+ * and a zero len writes the last-chunk marker instead.
+ * Return the written size on success, 0 on failure.
+ */
+static inline size_t fmt_chunk(char *dst, size_t maxlen, size_t len, bool crlf) {
+  if (!dst || maxlen == 0)
+    return 0;
+
+  int res_len;
+  if (len > 0)
+    res_len = snprintf(dst, maxlen, "%s%lx\r\n", crlf ? "\r\n" : "", len);
+  else
+    res_len = snprintf(dst, maxlen, "%s", crlf ? LAST_CHUNK : LAST_CHUNK + 2);
+
+  if (res_len < 0 || (size_t)res_len >= maxlen)
+    return 0;
+
+  return res_len;
+}
+
 /*
  * Send an empty HTTP response containing only the status
+ *
+ * The connection is closed right after for every status but 100 Continue, so the response is formatted once
+ * per status into a static table that outlives the send, instead of the connection buffers
  */
 static inline int send_empty_res(Status status) {
-  Conn *conn = current_conn;
+  static struct {
+    Status status;
+    size_t len;
+    char   str[64];
+  } empty_res[16];
+  static size_t nempty_res = 0;
 
-  if (!conn || conn->fd <= 0)
+  Conn *conn = current_conn;
+  if (!conn || conn->fd <= 0 || conn->closing)
     return -1;
 
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-  if (!sqe)
-    return -1;
+  size_t i = 0;
+  while (i < nempty_res && empty_res[i].status != status)
+    i++;
+
+  if (i == nempty_res) {
+    size_t res_len = STRLEN("HTTP/1.1 ")  // HTTP version
+                     + 4                  // status code + space
+                     + status_len(status) // status string
+                     + 4;                 // \r\n\r\n
+
+    if (i == sizeof(empty_res) / sizeof(empty_res[0]) || res_len >= sizeof(empty_res[i].str)
+        || snprintf(empty_res[i].str, res_len + 1, "HTTP/1.1 %d %s\r\n\r\n", (int)status, status_str(status))
+               != (int)res_len)
+      return -1;
 
-  size_t res_len = STRLEN("HTTP/1.1 ")  // HTTP version
-                   + 4                  // status code + space
-                   + status_len(status) // status string
-                   + 4;                 // \r\n\r\n
+    empty_res[i].status = status;
+    empty_res[i].len = res_len;
+    nempty_res++;
+  }
+
+  // Every other status ends the connection, the close waits for the response to be sent
+  if (status != STATUSCONTINUE)
+    return usend_last(conn, empty_res[i].str, empty_res[i].len);
 
-  IOV *rec = &conn->send.rec[0];
-  memset(rec->iov_base, 0, res_len);
-  if (snprintf((char *)rec->iov_base, res_len + 1, "HTTP/1.1 %d %s\r\n\r\n", (int)status, status_str(status))
-      != (int)res_len)
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe)
     return -1;
 
-  io_uring_prep_send(sqe, conn->fd, rec->iov_base, res_len, MSG_NOSIGNAL);
+  io_uring_prep_send(sqe, conn->fd, empty_res[i].str, empty_res[i].len, MSG_NOSIGNAL);
+  sqe->user_data = 0;
   return io_uring_submit(&ring);
 }
 
 /*
- * Read the request method from src
+ * Read the request method from the len bytes at src
  */
-static inline int read_method(Method *method, void *src) {
-  if (memcmp(src, "GET", STRLEN("GET")) == 0)
-    *method = GET;
-  else if (memcmp(src, "POST", STRLEN("POST")) == 0)
-    *method = POST;
-  else if (memcmp(src, "HEAD", STRLEN("HEAD")) == 0)
-    *method = HEAD;
-  else if (memcmp(src, "PUT", STRLEN("PUT")) == 0)
-    *method = PUT;
-  else if (memcmp(src, "DELETE", STRLEN("DELETE")) == 0)
-    *method = DELETE;
-  else if (memcmp(src, "CONNECT", STRLEN("CONNECT")) == 0)
-    *method = CONNECT;
-  else if (memcmp(src, "OPTIONS", STRLEN("OPTIONS")) == 0)
-    *method = OPTIONS;
-  else if (memcmp(src, "TRACE", STRLEN("TRACE")) == 0)
-    *method = TRACE;
-  else if (memcmp(src, "PATCH", STRLEN("PATCH")) == 0)
-    *method = PATCH;
-  else
-    return -1;
+static inline int read_method(Method *method, const char *src, size_t len) {
+  static const struct {
+    const char *name;
+    Method      method;
+  } methods[] = {
+      {"GET", GET},         {"POST", POST},       {"HEAD", HEAD},
+      {"PUT", PUT},         {"DELETE", DELETE},   {"CONNECT", CONNECT},
+      {"OPTIONS", OPTIONS}, {"TRACE", TRACE},     {"PATCH", PATCH},
+  };
+
+  for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    if (strlen(methods[i].name) == len && memcmp(src, methods[i].name, len) == 0) {
+      *method = methods[i].method;
+      return 0;
+    }
+  }
 
-  return 0;
+  return -1;
 }
 
 /*
- * Format the HTTP response and send it
+ * Read the method and the path from the request line in the len bytes at src.
+ * If query is set it points to the url parameters after the '?', or NULL if there are none.
+ * Return the offset of the first header line on success, -1 on failure
  */
-static inline int sendmsg_res(Request *req, ResWriter *res) {
-  IOV *iov, *rec;
-  rec = &current_conn->send.rec[0];
-  iov = &current_conn->send.iov[0];
-  memcpy(iov, rec, sizeof(IOV));
-
-  size_t res_size = fmt_res(req, res, iov->iov_base, rec->iov_len);
-  if (res_size > rec->iov_len)
+static inline long read_req_line(Request *req, char *src, size_t len, char **query, size_t *query_len) {
+  char *end = memchr(src, '\r', len);
+  if (!end || (size_t)(end - src) + 1 >= len || end[1] != '\n')
     return -1;
 
-  iov->iov_len = res_size;
-  current_conn->send.len += res_size;
-
-  return usendmsg(current_conn, 0, current_conn->send.iovlen);
-}
-
-static inline int parse_headers(char *start, char *end, Header *dstbuff, size_t maxHeaders) {
-  if (!start || !end || !dstbuff || maxHeaders == 0)
+  char *sep = memchr(src, ' ', end - src);
+  if (!sep || read_method(&req->method, src, sep - src) < 0)
     return -1;
 
-  size_t  i, key_len, val_len;
-  char   *head_start, *head_end, *key, *colon, *val;
-  Header *header = {0};
-
-  head_start = start;
-  for (i = 0; head_start && head_start < end && i < maxHeaders; i++) {
-    while (*head_start == '\r' || *head_start == '\n')
-      head_start++;
-
-    if (!head_start || *head_start == '\0' || head_start == end)
-      break;
-
-    while (*head_start == ' ')
-      head_start++;
+  char *path = sep + 1;
+  sep = memchr(path, ' ', end - path);
+  if (!sep || sep == path)
+    return -1;
 
-    key = head_start;
-    colon = strchr(key, ':');
-    if (!colon)
-      return -1;
+  char *mark = memchr(path, '?', sep - path);
+  req->path = path;
+  req->path_len = (mark ? mark : sep) - path;
+  if (query) {
+    *query = mark ? (mark + 1) : NULL;
+    *query_len = mark ? (size_t)(sep - (mark + 1)) : 0;
+  }
 
-    key_len = colon - key;
-    *colon = '\0';
+  return (end + 2) - src;
+}
 
-    val = (colon + 1);
-    while (*val == ' ')
-      val++;
+/*
+ * Split the header lines between start and end into dstbuff,
+ * recording the index + 1 of the first of each known header in known
+ */
+static inline int parse_headers(char *start, char *end, Header *dstbuff, size_t maxHeaders, uint16_t *known) {
+  if (!start || !end || !dstbuff || maxHeaders == 0)
+    return -1;
 
-    head_end = strchr(val, '\r');
-    if (!head_end)
+  size_t i;
+  int    res;
+  for (i = 0; i < maxHeaders && (res = next_header(&start, end, &dstbuff[i])) != 0; i++) {
+    if (res < 0)
       return -1;
 
-    val_len = head_end - val;
-    *head_end = '\0';
-
-    header = &dstbuff[i];
-    header->key = key;
-    header->value = val;
-    header->key_len = key_len;
-    header->value_len = val_len;
-
-    head_start = head_end + 1;
+    int index = classify_header(dstbuff[i].key, dstbuff[i].key_len);
+    if (index >= 0 && !known[index])
+      known[index] = i + 1;
   }
 
   return i;
@@ -693,119 +894,72 @@ static inline int parse_params(char *start, char *end, Param *dstbuff, size_t ma
   if (!start || !end || !dstbuff || maxParams == 0)
     return -1;
 
-  size_t i, key_len, val_len;
-  char  *param_start, *param_end, *key, *equ, *val;
-  Param *param = {0};
-
-  param_start = start;
-  while (*param_start == '?' || *param_start == '&')
-    param_start++;
-
-  for (i = 0; param_start && param_start < end && i < maxParams; i++) {
-    if (!param_start || *param_start == '\0' || param_start == end)
-      break;
-
-    while (*param_start == ' ')
-      param_start++;
-
-    key = param_start;
-    equ = strchr(key, '=');
-    if (!equ)
-      return -1;
-
-    key_len = equ - key;
-    *equ = '\0';
-
-    val = equ + 1;
-    while (*val == ' ')
-      val++;
-
-    param_end = strchr(val, '&');
-    if (!param_end) {
-      val_len = end - val;
-      param_start = NULL; // The end
-    } else {
-      val_len = param_end - val;
-      param_start = param_end + 1;
-      *param_end = '\0';
+  size_t i = 0;
+  char  *param_start = start;
+  while (param_start < end && i < maxParams) {
+    char *param_end = memchr(param_start, '&', end - param_start);
+    if (!param_end)
+      param_end = end;
+
+    // A key without '=' has an empty value
+    char *equ = memchr(param_start, '=', param_end - param_start);
+    char *key_end = equ ? equ : param_end;
+    if (key_end > param_start) {
+      Param *param = &dstbuff[i++];
+      param->key = param_start;
+      param->key_len = key_end - param_start;
+      param->value = equ ? (equ + 1) : param_end;
+      param->value_len = param_end - param->value;
     }
 
-    param = &dstbuff[i];
-    param->key = key;
-    param->value = val;
-    param->key_len = key_len;
-    param->value_len = val_len;
+    param_start = param_end + 1;
   }
 
   return i;
 }
 
 /*
- * Fill the request struct from the raw request
+ * Fill the request struct from the raw request head of len bytes.
+ * Only the request line is read, the headers and url parameters are split on first use.
+ * The request strings are slices of the head and are not NUL terminated
  */
-static inline int read_req(Request *req, char *req_buffer) {
+static inline int read_req(Request *req, char *req_buffer, size_t len) {
   if (!req_buffer)
     return -1;
-  /*** Method ***/
-  char *sep = strchr(req_buffer, ' ');
-  if (!sep)
-    return -1;
-
-  *sep = '\0';
-  if (read_method(&req->method, req_buffer) < 0)
-    return -1;
 
-  /*** Path ***/
-  char *fullpath = sep + 1;
-  sep = strchr(fullpath, ' ');
-  if (!sep)
+  long offset = read_req_line(req, req_buffer, len, &req->query, &req->query_len);
+  if (offset < 0)
     return -1;
 
-  *sep = '\0';
-  req->path = fullpath;
-
-  /*** Params ***/
-  char *paramStart = strchr(fullpath, '?');
-  if (paramStart) {
-    *paramStart++ = '\0';
-    int params_count = parse_params(paramStart, sep, req->params, config.max_nparams);
-    if (params_count > 0)
-      req->params_count = params_count;
-    else
-      req->params_count = 0;
-  } else {
-    req->params = NULL;
-    req->params_count = 0;
-  }
-
-  /*** Headers ***/
-  char *headStart = strstr(sep + 1, "\r\n");
-  char *headEnd = strstr(sep + 1, "\r\n\r\n");
-  if (!headStart)
-    return -1;
+  req->head = req_buffer + offset;
+  req->head_end = req_buffer + len;
+  return 0;
+}
 
-  int headers_count = parse_headers(headStart, headEnd, req->headers, config.max_nheaders);
-  if (headers_count <= 0)
-    return -1;
-  req->headers_count = headers_count;
+/*
+ * Read the port from the Host header, the default http port if it has none
+ */
+static inline uint16_t read_port(Header *host) {
+  char *end = host->value + host->value_len;
+  char *colon = memrchr(host->value, ':', host->value_len);
+  long  port = -1;
+  if (colon && !memchr(colon, ']', end - colon)) // Not inside an IPv6 address
+    port = slice_to_long(colon + 1, end - (colon + 1));
+
+  return (port > 0 && port <= UINT16_MAX) ? port : DEF_HTTP_PORT;
+}
 
-  /*** Host ***/
-  int index = HK_get_header(req, "Host");
-  if (index < 0)
-    return -1;
-  char *host = req->headers[index].value;
-  // req->hostname = host;
-
-  /*** Port ***/
-  char *colon = strchr(host, ':');
-  if (colon) {
-    *colon++ = '\0';
-    req->port = atoi(colon);
-  } else {
-    req->port = DEF_HTTP_PORT;
+/*
+ * Count the occurrences of c between start and end
+ */
+static inline size_t count_char(const char *start, const char *end, char c) {
+  size_t count = 0;
+  while (start < end && (start = memchr(start, c, end - start))) {
+    count++;
+    start++;
   }
 
-  return 0;
+  return count;
 }
 
 static inline int _get_pair(Pair *pairs, size_t npairs, const char *key) {
@@ -813,7 +967,7 @@ static inline int _get_pair(Pair *pairs, size_t npairs, const char *key) {
     return -1;
 
   for (size_t i = 0; i < npairs; i++)
-    if (pairs[i].key && pairs[i].key[0] != '\0' && strcasecmp(pairs[i].key, key) == 0)
+    if (pairs[i].key && slice_equ(pairs[i].key, pairs[i].key_len, key))
       return i;
 
   return -1;
@@ -823,12 +977,32 @@ static inline void _serv_default_config(ServConfig *config) {
   config->max_req_body_size = DEF_MAX_REQ_SIZE;
   config->max_headers_size = DEF_MAX_HEAD_SIZE;
   config->max_writes_per_handler = DEF_MAX_WRITE_CALLS;
+  config->body_window_size = DEF_BODY_WINDOW;
   config->max_nparams = DEF_MAX_URL_PARAMS;
   config->max_nheaders = DEF_MAX_NHEADERS;
   config->max_concurrent_clients = DEF_MAX_CONNS;
   config->mem_pool_size = DEF_POOL_SIZE;
+  config->mem_cache_size = DEF_MEM_CACHE_SIZE;
+  config->reclaim_interval_ms = 0;
+  config->queue_target_ms = DEF_QUEUE_TARGET;
+  config->queue_interval_ms = DEF_QUEUE_INTERVAL;
+  config->ring_entries = DEF_RING_ENTRIES;
+  config->header_timeout_ms = DEF_HEADER_TIMEOUT;
+  config->body_min_rate = DEF_BODY_MIN_RATE;
+  config->idle_timeout_ms = DEF_IDLE_TIMEOUT;
+  config->send_timeout_ms = DEF_SEND_TIMEOUT;
+  config->busy_poll_us = 0;
+  config->prefer_busy_poll = false;
   config->multi_core = false;
+  config->worker_cpus = NULL;
+  config->one_worker_per_core = false;
+  config->rebalance_interval_ms = DEF_REBALANCE_INTERVAL;
+  config->tls_cert_file = NULL;
+  config->tls_key_file = NULL;
   config->pool_only = false;
+  config->huge_pages = HUGE_PAGES_NONE;
+  config->prefault_pool = false;
+  config->lock_pool = false;
 }
 
 #endif
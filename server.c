@@ -1,4 +1,6 @@
+#include "balance.h"
 #include "serv.h"
+#include "topo.h"
 #include <sched.h>
 #include <sys/prctl.h>
 #include <sys/sysinfo.h>
@@ -8,24 +10,40 @@ int HK_listen(Server *serv) {
   if (!serv->config.multi_core)
     return serv_listen(serv);
 
-  int nprocs = get_nprocs();
-  for (int i = 0; i < nprocs; i++) {
+  config = serv->config;
+  Worker *workers = malloc(sizeof(Worker) * CPU_SETSIZE);
+  if (!workers)
+    return -1;
+
+  int nworkers = place_workers(workers, CPU_SETSIZE);
+  if (nworkers < 0) {
+    free(workers);
+    return -1;
+  }
+
+  // Not fatal, the workers keep the connections they accept
+  if (config.rebalance_interval_ms && nworkers > 1 && init_balance(nworkers) < 0)
+    fprintf(stderr, "multi_core workers won't rebalance connections\n");
+
+  for (int i = 0; i < nworkers; i++) {
     pid_t pid = fork();
     if (pid < 0) {
       exit(EXIT_FAILURE);
     } else if (pid == 0) {
-      cpu_set_t cpuset;
-      CPU_ZERO(&cpuset);
-      CPU_SET(i, &cpuset);
-      if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) < 0)
+      Worker worker = workers[i];
+      free(workers);
+      if (bind_worker(&worker) < 0)
         return -1;
       prctl(PR_SET_PDEATHSIG, SIGTERM);
+      join_balance(i);
 
       return serv_listen(serv);
     } else {
-      fprintf(stderr, "process %d running\n", pid);
+      fprintf(stderr, "process %d running on cpu %d node %d\n", pid, workers[i].cpu, workers[i].node);
     }
   }
+  free(workers);
+  leave_balance();
   wait(NULL);
   return 0;
 }